@@ -0,0 +1,142 @@
+// Host-side microbenchmark of the scanners in JsonScan.h. Each payload is tokenized the way JsonParser moves through
+// its read buffer: whitespace skipped, string bodies run to their closing quote, and literals run to the next
+// structural character. The scanner JsonScan.h picked for this build is timed against a byte-at-a-time loop; Build
+// once per scanner with the Makefile alongside to compare them all.
+#include "JsonScan.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+#if defined(SPHUE_JSON_SCAN_IMPL_SCALAR)
+const char kScanner[] = "scalar";
+#elif defined(SPHUE_JSON_SCAN_IMPL_SWAR)
+const char kScanner[] = "swar";
+#elif defined(SPHUE_JSON_SCAN_IMPL_AVX2)
+const char kScanner[] = "avx2";
+#else
+const char kScanner[] = "sse2";
+#endif
+
+const char *const kDefaultPayloads[] = {
+    "fixtures/lights.json",
+    "fixtures/groups.json",
+    "fixtures/scenes.json",
+};
+
+// Spends at least this long on each payload and scanner, so that short payloads still time reliably.
+const double kMinSeconds = 0.2;
+
+struct Bytewise {
+  static const char *findStringEnd(const char *p, const char *end) {
+    while (p < end && !json::scan::isStringEnd(*p)) {
+      ++p;
+    }
+    return p;
+  }
+
+  static const char *skipWhitespace(const char *p, const char *end) {
+    while (p < end && json::scan::isWhitespace(*p)) {
+      ++p;
+    }
+    return p;
+  }
+};
+
+struct Compiled {
+  static const char *findStringEnd(const char *p, const char *end) {
+    return json::scan::findStringEnd(p, end);
+  }
+
+  static const char *skipWhitespace(const char *p, const char *end) {
+    return json::scan::skipWhitespace(p, end);
+  }
+};
+
+// Returns the number of tokens in [p, end).
+template<typename Scanner>
+size_t tokenize(const char *p, const char *end) {
+  size_t tokens = 0;
+  while ((p = Scanner::skipWhitespace(p, end)) < end) {
+    ++tokens;
+    if (*p == '"') {
+      // Escapes are stepped over two bytes at a time; The next stop is the closing quote.
+      for (p = Scanner::findStringEnd(p + 1, end); p < end && *p == '\\'; p = Scanner::findStringEnd(p, end)) {
+        p = (end - p > 2) ? p + 2 : end;
+      }
+      p = (p < end) ? p + 1 : end;
+    } else if (json::scan::isStructural(*p)) {
+      ++p;
+    } else {
+      p = json::scan::findStructural(p, end);
+    }
+  }
+  return tokens;
+}
+
+// Returns the throughput in MB/s, and the token count in `tokens`.
+template<typename Scanner>
+double measure(const std::string &payload, size_t &tokens) {
+  const char *begin = payload.data();
+  const char *end = begin + payload.size();
+  typedef std::chrono::steady_clock Clock;
+  size_t runs = 0;
+  size_t sink = 0;
+  const Clock::time_point start = Clock::now();
+  double elapsed;
+  do {
+    for (int i = 0; i < 64; ++i) {
+      sink += tokenize<Scanner>(begin, end);
+    }
+    runs += 64;
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < kMinSeconds);
+  tokens = sink / runs;
+  return (double) payload.size() * runs / elapsed / 1e6;
+}
+
+bool load(const char *path, std::string &payload) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  payload = contents.str();
+  return true;
+}
+
+}
+
+// Usage: json_scan_<scanner> [payload.json ...]; Defaults to the recorded bridge payloads in fixtures/.
+int main(int argc, char **argv) {
+  const char *const *first = kDefaultPayloads;
+  const char *const *last = kDefaultPayloads + sizeof(kDefaultPayloads) / sizeof(kDefaultPayloads[0]);
+  if (argc > 1) {
+    first = argv + 1;
+    last = argv + argc;
+  }
+  printf("%-24s %8s %8s %12s %12s %8s\n", "payload", "bytes", "scanner", "bytewise", "word-wise", "speedup");
+  for (; first != last; ++first) {
+    const char *path = *first;
+    std::string payload;
+    if (!load(path, payload)) {
+      fprintf(stderr, "Can't read %s\n", path);
+      return 1;
+    }
+    size_t expected;
+    size_t tokens;
+    const double bytewise = measure<Bytewise>(payload, expected);
+    const double scanner = measure<Compiled>(payload, tokens);
+    if (tokens != expected) {
+      fprintf(stderr, "%s: %s found %zu tokens, bytewise %zu\n", path, kScanner, tokens, expected);
+      return 1;
+    }
+    printf("%-24s %8zu %8s %7.1f MB/s %7.1f MB/s %7.2fx\n", path, payload.size(), kScanner, bytewise, scanner,
+           scanner / bytewise);
+  }
+  return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef SPHUE_BENCH_HOST_ARDUINO_H_
+#define SPHUE_BENCH_HOST_ARDUINO_H_
+
+// Just enough of Arduino.h for the headers the benchmarks include.
+#include <stddef.h>
+#include <stdint.h>
+
+#endif //SPHUE_BENCH_HOST_ARDUINO_H_
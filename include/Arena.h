@@ -0,0 +1,147 @@
+#ifndef SPHUE_INCLUDE_ARENA_H_
+#define SPHUE_INCLUDE_ARENA_H_
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace sphue {
+
+// A bump allocator over a single heap block. Allocations are never freed individually; The whole block is released
+// when the arena is destroyed. Requests that do not fit are served from the heap instead. Arenas are shared, so that
+// every ArenaAllocator drawing from one keeps it alive.
+class Arena {
+ public:
+  explicit Arena(size_t size);
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns nullptr when the request does not fit.
+  void *allocate(size_t size, size_t align);
+  // Only the most recent allocation is given back; Anything else is reclaimed with the arena.
+  void deallocate(void *ptr, size_t size);
+  bool owns(const void *ptr) const;
+
+  size_t size() const;
+  size_t used() const;
+  // Highest `used()` seen over the arena's lifetime. Size arenas from this.
+  size_t peak() const;
+  // Bytes that did not fit and were allocated from the heap instead.
+  size_t overflow() const;
+
+  // The arena that new ArenaAllocators draw from, if any.
+  static std::shared_ptr<Arena> current();
+
+ private:
+  friend class ArenaScope;
+
+  char *block_;
+  size_t size_;
+  size_t used_ = 0;
+  size_t peak_ = 0;
+  size_t overflow_ = 0;
+
+  static const std::shared_ptr<Arena> *current_;
+};
+
+
+// Makes `arena` the current arena for as long as the scope is alive. Scopes nest; A null `arena` leaves the current
+// arena in place.
+class ArenaScope {
+ public:
+  explicit ArenaScope(std::shared_ptr<Arena> arena);
+  ~ArenaScope();
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+ private:
+  std::shared_ptr<Arena> arena_;
+  const std::shared_ptr<Arena> *previous_;
+};
+
+
+// An allocator that draws from the arena current when it was created, and falls back to the heap when there was none
+// (or it is full). It holds on to its arena and moves with the container's memory, so a container filled in an
+// ArenaScope can be moved anywhere and outlive everything else that used the arena. Copies draw from the arena current
+// where they are made, like new containers.
+template<typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template<typename U>
+  struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena_(Arena::current()) {
+    //
+  }
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena_) {
+    //
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+
+  T *allocate(size_t count) {
+    void *ptr = arena_ ? arena_->allocate(count * sizeof(T), alignof(T)) : nullptr;
+    return (T *) (ptr ? ptr : ::operator new(count * sizeof(T)));
+  }
+
+  void deallocate(T *ptr, size_t count) {
+    if (arena_ && arena_->owns(ptr)) {
+      arena_->deallocate(ptr, count * sizeof(T));
+    } else {
+      ::operator delete(ptr);
+    }
+  }
+
+  template<typename U, typename... Args>
+  void construct(U *ptr, Args &&... args) {
+    ::new((void *) ptr) U(std::forward<Args>(args)...);
+  }
+
+  template<typename U>
+  void destroy(U *ptr) {
+    ptr->~U();
+  }
+
+  size_t max_size() const {
+    return ((size_t) -1) / sizeof(T);
+  }
+
+  template<typename U>
+  bool operator==(const ArenaAllocator<U> &other) const {
+    return arena_ == other.arena_;
+  }
+
+  template<typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena_ != other.arena_;
+  }
+
+ private:
+  template<typename U>
+  friend class ArenaAllocator;
+
+  std::shared_ptr<Arena> arena_;
+};
+
+}
+
+#endif //SPHUE_INCLUDE_ARENA_H_
@@ -0,0 +1,209 @@
+#ifndef SPHUE_INCLUDE_HTTP_H_
+#define SPHUE_INCLUDE_HTTP_H_
+
+#include <Client.h>
+#include <vector>
+#include "JSON.h"
+
+// Size of the buffer requests are assembled in before being handed to the Client. Each flush is one write into the
+// network stack, so this should hold the headers and body of a typical state change.
+#ifndef SPHUE_HTTP_BUFFER_SIZE
+#define SPHUE_HTTP_BUFFER_SIZE 256
+#endif
+
+// How long, in milliseconds, an idle connection is kept for the next request. The bridge closes idle connections on
+// its own after a while; Past this the connection is reopened rather than sending on one that may already be gone.
+#ifndef SPHUE_HTTP_IDLE_TIMEOUT
+#define SPHUE_HTTP_IDLE_TIMEOUT 5000
+#endif
+
+// Requests written ahead of their responses by pipelined calls such as Sphue::setLightStates(). Responses wait in the
+// network stack until read, so this bounds how much of its receive buffer they can take up.
+#ifndef SPHUE_HTTP_PIPELINE_DEPTH
+#define SPHUE_HTTP_PIPELINE_DEPTH 8
+#endif
+
+// Largest response body an asynchronous call keeps in memory to parse once complete; Larger ones fail the call.
+// Bodies parsed as they arrive, such as the results of state changes, are not kept and not limited.
+#ifndef SPHUE_ASYNC_MAX_BODY
+#define SPHUE_ASYNC_MAX_BODY 8192
+#endif
+
+namespace http {
+
+// Collects small writes in a fixed buffer and passes them on in blocks. Writing a request into a socket a few bytes at
+// a time would send a packet per write.
+class BufferedPrint : public Print {
+ public:
+  explicit BufferedPrint(Print &out);
+  ~BufferedPrint() override;
+  BufferedPrint(const BufferedPrint &) = delete;
+  BufferedPrint &operator=(const BufferedPrint &) = delete;
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  void flush() override;
+
+ private:
+  Print &out_;
+  uint8_t buffer_[SPHUE_HTTP_BUFFER_SIZE];
+  size_t length_ = 0;
+};
+
+
+// The body of a response read from a Connection. Reads stop at the end of the body, whether it is sized by
+// Content-Length, chunked, or runs until the bridge closes the connection.
+class Body : public Stream {
+  friend class Connection;
+
+ public:
+  explicit Body(Client &client);
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char *buffer, size_t length) override;
+  size_t write(uint8_t c) override;
+
+ private:
+  Client &client_;
+  // Bytes left in the body, or in the current chunk. Negative when the body runs until the connection closes.
+  long remaining_;
+  bool chunked_;
+  bool first_chunk_;
+  bool done_;
+
+  void reset(long length, bool chunked);
+  bool ready();
+  bool nextChunk();
+};
+
+
+// A response read by Connection::poll() as it arrives, without waiting on the Client. The body is either fed to a
+// JsonPushParser as it is decoded, or kept in memory, up to SPHUE_ASYNC_MAX_BODY bytes, and read back as a Stream once
+// the response is complete.
+class AsyncResponse : public Stream {
+  friend class Connection;
+
+ public:
+  enum Status : uint8_t {
+    RECEIVING,
+    COMPLETE,
+    FAILED
+  };
+
+  AsyncResponse();
+
+  Status status() const;
+  int statusCode() const;
+  // Prepares for another response, and resets the parser if one is set.
+  void reset();
+  // Feeds the body to `parser` instead of keeping it; nullptr (default) keeps it.
+  void setParser(json::JsonPushParser *parser);
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char *buffer, size_t length) override;
+  size_t write(uint8_t c) override;
+
+ private:
+  enum Phase : uint8_t {
+    STATUS_LINE,
+    HEADER,
+    BODY,
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_END,
+    TRAILER
+  };
+
+  json::JsonPushParser *parser_ = nullptr;
+  std::vector<char> body_;
+  size_t position_;
+  char line_[64];
+  uint8_t line_length_;
+  // Bytes left in the body, or in the current chunk. Negative when the body runs until the connection closes.
+  long remaining_;
+  int status_code_;
+  Status status_;
+  Phase phase_;
+  bool chunked_;
+  bool keep_alive_;
+  // Whether any of the response has arrived.
+  bool received_;
+
+  // Consumes up to `length` bytes and returns the number used; Stops at the end of the response.
+  size_t feed(const char *data, size_t length);
+  void endLine();
+  // Passes on a piece of the body; Fails the response if it would be kept past SPHUE_ASYNC_MAX_BODY.
+  bool append(const char *data, size_t length);
+  // The connection closed; Ends a body that runs until then, and fails anything else.
+  void close();
+};
+
+
+// An HTTP/1.1 connection to the bridge over a caller-provided Client, such as a WiFiClient. The connection is kept
+// open between requests; If the bridge closed it in the meantime, it is reopened and the request sent again.
+class Connection {
+ public:
+  Connection(Client &client, const char *host, uint16_t port);
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  // Sends a request, serializing `body` (if any) straight into the connection, and reads the response headers. The
+  // response body is read from the returned stream; Call finish() when done with it.
+  Stream &send(const char *method, const char *path, json::JsonSerializable *body);
+  // As above, with a body that is already serialized.
+  Stream &send(const char *method, const char *path, const char *body, size_t length);
+  // Pipelining; Writes a request without waiting for its response, returning false if it could not be written.
+  // Responses are then read in order with receive(), each followed by finish(). Don't mix with send() while requests
+  // are pending.
+  bool write(const char *method, const char *path, const char *body, size_t length);
+  Stream &receive();
+  // Non-blocking; Reads what has arrived of the response to the oldest pending request into `response`. Once that is
+  // no longer RECEIVING, the request is done with and the connection closed unless it can be reused.
+  AsyncResponse::Status poll(AsyncResponse &response);
+  uint8_t pending() const;
+  // Whether the last request went unanswered because the connection closed before any of its response arrived. Such
+  // a request may not have reached the bridge, and can be sent again if isRetriable(). A response that is merely slow
+  // to arrive doesn't count.
+  bool dropped() const;
+  // Whether a request with `method` may be sent again after it was dropped; POST is not.
+  static bool isRetriable(const char *method);
+  int statusCode() const;
+  // Reads off what is left of the response body, and closes the connection unless it can be reused. Requests still
+  // pending on a closed connection go unanswered.
+  void finish();
+  // Closes the connection, abandoning any pending requests.
+  void close();
+  // Zero closes the connection after every request.
+  void setIdleTimeout(unsigned long timeout);
+
+ private:
+  Client &client_;
+  String host_;
+  uint16_t port_;
+  int status_code_ = 0;
+  Body body_;
+  unsigned long idle_timeout_ = SPHUE_HTTP_IDLE_TIMEOUT;
+  unsigned long last_used_ = 0;
+  // Whether the current response leaves the connection open for another request.
+  bool reusable_ = false;
+  // Whether the request went out on a connection kept from an earlier one.
+  bool reused_ = false;
+  // Whether the last request couldn't be sent, or got nothing back before the connection closed.
+  bool dropped_ = false;
+  // Requests written with write() whose responses have not been received.
+  uint8_t pending_ = 0;
+
+  bool begin();
+  bool end(bool sent);
+  void writeHead(Print &out, const char *method, const char *path, bool has_body, size_t length);
+  bool readHead();
+  bool readLine(char *dest, size_t size);
+};
+
+}
+
+#endif //SPHUE_INCLUDE_HTTP_H_
@@ -2,14 +2,43 @@
 #define SPHUE_INCLUDE_JSON_H_
 
 #include <Stream.h>
+#include <Print.h>
+#include "NumberFormat.h"
 #include <memory>
-#include <deque>
+#include <vector>
+#include <algorithm>
 #include <map>
+#include <limits>
+#include <functional>
+
+// Size of the block buffer JsonParser reads its source stream into. Larger buffers mean fewer calls into the
+// underlying Stream (and WiFi stack) per response, at the cost of heap while a parser is alive.
+#ifndef SPHUE_JSON_BUFFER_SIZE
+#define SPHUE_JSON_BUFFER_SIZE 256
+#endif
+
+// Number of members a JsonCompactObject holds inline; At least every key a GroupStateChange can set.
+#ifndef SPHUE_JSON_COMPACT_SIZE
+#define SPHUE_JSON_COMPACT_SIZE 15
+#endif
+
+// Limits for JsonPath projections; Keys longer than SPHUE_JSON_PATH_KEY_SIZE - 1 only match wildcard segments.
+#ifndef SPHUE_JSON_PATH_MAX_DEPTH
+#define SPHUE_JSON_PATH_MAX_DEPTH 6
+#endif
+#ifndef SPHUE_JSON_PATH_KEY_SIZE
+#define SPHUE_JSON_PATH_KEY_SIZE 20
+#endif
 
 namespace json {
 
 unsigned long strToLong(String &value);
 
+// Writes `length` bytes of `value` to `out` as a quoted JSON string, escaping as needed.
+size_t printString(Print &out, const char *value, size_t length);
+// The number of bytes printString() writes for `value`.
+size_t measureString(const char *value, size_t length);
+
 
 class JsonParser;
 
@@ -36,45 +65,158 @@ enum JsonNumberType {
 };
 
 
+// A table of PROGMEM key strings, sorted in ascending (strcmp) order. A key's index in the table is its field ID.
+struct JsonKeyTable {
+  const char * const *keys;
+  uint8_t size;
+};
+
+#define MAKE_KEY_TABLE(name, ...) \
+  const char * const name##_keys[] PROGMEM = {__VA_ARGS__}; \
+  const json::JsonKeyTable name = {name##_keys, (uint8_t) (sizeof(name##_keys) / sizeof(name##_keys[0]))};
+
+
 class JsonModel {
   friend class JsonParser;
 
  private:
-  virtual bool onKey(String &key, JsonParser &parser) = 0;
+  // Models with a fixed set of keys return a key table. The parser matches each key against it straight off the
+  // input and calls onField() with the key's index; Unknown keys are skipped without being copied.
+  virtual const JsonKeyTable *keyTable() const {
+    return nullptr;
+  }
+  virtual bool onField(uint8_t field, JsonParser &parser) {
+    return false;
+  }
+  // Models without a key table receive every key as a String.
+  virtual bool onKey(String &key, JsonParser &parser) {
+    return false;
+  }
 };
 
 
+// Receives parse events from JsonParser::parse(). Every callback returns true to continue or false to stop parsing.
+// Strings and keys are passed in a scratch String that is reused for the next event.
+class JsonHandler {
+ public:
+  virtual bool onStartObject() {
+    return true;
+  }
+  virtual bool onEndObject() {
+    return true;
+  }
+  virtual bool onStartArray() {
+    return true;
+  }
+  virtual bool onEndArray() {
+    return true;
+  }
+  virtual bool onKey(const String &key) {
+    return true;
+  }
+  virtual bool onString(const String &value) {
+    return true;
+  }
+  // Numbers without a fraction or exponent arrive through onInteger(), all others through onNumber().
+  virtual bool onInteger(long value) {
+    return true;
+  }
+  virtual bool onNumber(double value) {
+    return true;
+  }
+  virtual bool onBool(bool value) {
+    return true;
+  }
+  virtual bool onNull() {
+    return true;
+  }
+};
+
+
+// A compiled path into a JSON document, such as "/*/state/on". Each segment matches an object key or array index
+// exactly; `*` matches any key or index. The path string is not copied and must outlive the JsonPath.
+class JsonPath {
+  friend class JsonParser;
+
+ public:
+  explicit JsonPath(const char *path);
+
+  uint8_t depth() const;
+  explicit operator bool() const;
+
+ private:
+  const char *path_;
+  uint8_t depth_;
+  bool valid_;
+  uint8_t starts_[SPHUE_JSON_PATH_MAX_DEPTH];
+  uint8_t lengths_[SPHUE_JSON_PATH_MAX_DEPTH];
+
+  bool matches(uint8_t depth, const char *key, size_t length) const;
+};
+
+
+// Describes a value reached by a JsonPath: which of the projected paths matched and the key (or array index) taken
+// at each level on the way there.
+class JsonPathMatch {
+  friend class JsonParser;
+
+ public:
+  uint8_t path() const;
+  uint8_t depth() const;
+  const char *key(uint8_t depth) const;
+
+ private:
+  uint8_t path_ = 0;
+  uint8_t depth_ = 0;
+  char keys_[SPHUE_JSON_PATH_MAX_DEPTH][SPHUE_JSON_PATH_KEY_SIZE] = {};
+};
+
+
+// Called with the parser positioned on a matched value. Return true after consuming the value with one of the
+// parser's get() methods, or false to have it skipped.
+typedef std::function<bool(JsonParser &parser, const JsonPathMatch &match)> JsonPathCallback;
+
+
 class JsonParser {
   friend class JsonModel;
 
  public:
-  explicit JsonParser(Stream &src);
+  explicit JsonParser(Stream &src, size_t buffer_size = SPHUE_JSON_BUFFER_SIZE);
+  // Parse using a caller-provided buffer; No heap allocation is made for the read window.
+  JsonParser(Stream &src, char *buffer, size_t buffer_size);
+  ~JsonParser();
+  JsonParser(const JsonParser &) = delete;
+  JsonParser &operator=(const JsonParser &) = delete;
 
   bool get(JsonModel &dest);
   bool get(bool &dest);
-  bool get(unsigned long &dest);
+  // Integers are accumulated directly and clamped to the destination's range. Floating point is only used when the
+  // value has a fraction or exponent. Quoted integers, as the Hue API uses for IDs, are accepted as well.
+  bool get(unsigned long &dest) {
+    return getInteger(dest);
+  }
+  bool get(long &dest) {
+    return getInteger(dest);
+  }
   bool get(int &dest) {
-    unsigned long tmp;
-    bool success = get(tmp);
-    dest = tmp;
-    return success;
+    return getInteger(dest);
   }
   bool get(uint8_t &dest) {
-    unsigned long tmp;
-    bool success = get(tmp);
-    dest = tmp;
-    return success;
+    return getInteger(dest);
   }
   bool get(uint16_t &dest) {
-    unsigned long tmp;
-    bool success = get(tmp);
-    dest = tmp;
-    return success;
+    return getInteger(dest);
   }
   bool get(double &dest);
   bool get(float &dest) {
-    return get((double &) dest);
+    double tmp;
+    bool success = get(tmp);
+    if (success) {
+      dest = (float) tmp;
+    }
+    return success;
   }
+  // Appends the string at the current position to `dest`, decoding escape sequences (\uXXXX to UTF-8).
   bool get(String &dest);
   //bool getHexString(int &dest);
 
@@ -102,17 +244,130 @@ class JsonParser {
     return JsonArrayIterator<T>(*this);
   }
 
+  // Walks the next value, skipping everything that is not on one of `paths` and handing each value a path reaches to
+  // `callback`. Nothing off the paths is materialized.
+  bool project(const JsonPath &path, const JsonPathCallback &callback);
+  bool project(const JsonPath *paths, uint8_t count, const JsonPathCallback &callback);
+
+  // Walks the next value and reports it to `handler` as a stream of events. Iterative; Nesting is limited to 32 levels.
+  bool parse(JsonHandler &handler);
+
  private:
   Stream &src_;
+  char *buffer_;
+  size_t buffer_size_;
+  bool owns_buffer_;
+  // Unconsumed window of the buffer; [pos_, end_)
+  const char *pos_;
+  const char *end_;
+  // Set once a read times out with nothing; Later reads fail at once instead of waiting out the timeout again.
+  bool exhausted_ = false;
+
+  bool fill();
+  inline bool available() {
+    return pos_ < end_ || fill();
+  }
+  inline int peek() {
+    return available() ? (unsigned char) *pos_ : -1;
+  }
+  inline int read() {
+    return available() ? (unsigned char) *pos_++ : -1;
+  }
 
   bool findNextKey(String &dest);
+  bool findNextKey(const JsonKeyTable &table, int &field);
+  bool skipString();
+  bool skipUntil(const char *stops, bool nested);
+  bool getKey(char *dest, size_t size, size_t &length);
+  bool projectValue(const JsonPath *paths, uint8_t count, uint16_t active, JsonPathMatch &match,
+                    const JsonPathCallback &callback);
 
-  bool getDigits(unsigned long &dest, bool allow_sign);
-  bool getExponent(double &dest);
+  template<typename T>
+  bool getInteger(T &dest) {
+    unsigned long magnitude;
+    bool negative;
+    if (!getInteger(magnitude, negative)) {
+      return false;
+    }
+    if (negative) {
+      const unsigned long limit = std::numeric_limits<T>::is_signed
+                                  ? (unsigned long) std::numeric_limits<T>::max() + 1 : 0;
+      dest = (magnitude >= limit) ? std::numeric_limits<T>::min() : (T) -(long) magnitude;
+    } else {
+      dest = (magnitude > (unsigned long) std::numeric_limits<T>::max()) ? std::numeric_limits<T>::max() : (T) magnitude;
+    }
+    return true;
+  }
+  bool getInteger(unsigned long &magnitude, bool &negative);
+  bool getNumber(unsigned long &magnitude, bool &negative, double &real, bool &is_real);
+  bool getDigits(unsigned long &dest, int &used, int &count);
+  bool getExponent(int &dest);
   bool getPrecision(double &dest);
 };
 
 
+// A resumable parser that is fed input as it arrives instead of pulling it from a blocking Stream. Each call to
+// feed() consumes what it is given, reports events to the handler and returns NEED_MORE until a complete value has
+// been read, so a large response can be parsed over many loop() iterations.
+class JsonPushParser {
+ public:
+  enum Status {
+    NEED_MORE,
+    COMPLETE,
+    FAILED
+  };
+
+  explicit JsonPushParser(JsonHandler &handler);
+  JsonPushParser(const JsonPushParser &) = delete;
+  JsonPushParser &operator=(const JsonPushParser &) = delete;
+
+  Status feed(const char *data, size_t length);
+  // Consumes at most `budget` bytes that `src` already has available; Never waits for more.
+  Status feed(Stream &src, size_t budget = SPHUE_JSON_BUFFER_SIZE);
+  // Signals the end of input. Only needed to complete a bare top-level number.
+  Status finish();
+  Status status() const;
+  // Prepares the parser for a new document.
+  void reset();
+
+ private:
+  enum State : uint8_t {
+    VALUE,
+    FIRST_KEY,
+    KEY,
+    COLON,
+    FIRST_VALUE,
+    NEXT,
+    STRING_BODY,
+    NUMBER_BODY,
+    LITERAL_BODY
+  };
+
+  JsonHandler &handler_;
+  Status status_;
+  State state_;
+  // One bit per open container; Set for arrays, clear for objects.
+  uint32_t arrays_;
+  uint8_t depth_;
+  // The string, key or number being read.
+  String token_;
+  bool is_key_;
+  bool escaped_;
+  bool has_escapes_;
+  const char *literal_;
+  uint8_t matched_;
+
+  const char *step(const char *p, const char *end);
+  const char *readString(const char *p, const char *end);
+  const char *readNumber(const char *p, const char *end);
+  const char *readLiteral(const char *p, const char *end);
+  bool startValue(char c);
+  bool endValue();
+  bool emitNumber();
+  bool emitLiteral();
+};
+
+
 template<typename T>
 class JsonArrayIterator {
  public:
@@ -142,7 +397,14 @@ class JsonArrayIterator {
 
 class JsonSerializable {
  public:
-  virtual String toJson() = 0;
+  virtual ~JsonSerializable() = default;
+
+  // Serializes into a String sized by measureJson(), so it is allocated exactly once.
+  virtual String toJson();
+  // Writes the value straight to `out`, without building it in memory first. Returns the number of bytes written.
+  virtual size_t printTo(Print &out) = 0;
+  // The exact number of bytes printTo() will write, computed without building anything.
+  virtual size_t measureJson() = 0;
 };
 
 
@@ -152,7 +414,8 @@ class JsonString : public JsonSerializable {
   explicit JsonString(String &value);
   const String &getValue() const;
   void setValue(String &value);
-  String toJson() override;
+  size_t printTo(Print &out) override;
+  size_t measureJson() override;
   bool operator==(const JsonString &rhs) const;
   bool operator!=(const JsonString &rhs) const;
 };
@@ -164,7 +427,8 @@ class JsonBool : public JsonSerializable {
   explicit JsonBool(bool value);
   bool getValue();
   void setValue(bool value);
-  String toJson() override;
+  size_t printTo(Print &out) override;
+  size_t measureJson() override;
   bool operator==(const JsonBool &rhs) const;
   bool operator!=(const JsonBool &rhs) const;
 };
@@ -189,7 +453,8 @@ class JsonNumber : public JsonSerializable {
   void setValue(float value);
   void setType(JsonNumberType type);
 
-  String toJson() override;
+  size_t printTo(Print &out) override;
+  size_t measureJson() override;
 
   bool operator==(const JsonNumber &rhs) const;
   bool operator!=(const JsonNumber &rhs) const;
@@ -198,25 +463,200 @@ class JsonNumber : public JsonSerializable {
 
 template<typename SerializableType>
 class JsonArray : public JsonSerializable {
-  std::deque<SerializableType> values_;
+  std::vector<SerializableType> values_;
  public:
   JsonArray() = default;
-  explicit JsonArray(int initial_capacity);
-  void add(SerializableType &value);
-  bool remove(SerializableType &value);
+
+  explicit JsonArray(int initial_capacity) {
+    values_.reserve(initial_capacity);
+  }
+
+  void add(SerializableType &value) {
+    values_.push_back(value);
+  }
+
+  bool remove(SerializableType &value) {
+    auto entry = std::find(values_.begin(), values_.end(), value);
+    if (entry == values_.end()) {
+      return false;
+    }
+    values_.erase(entry);
+    return true;
+  }
+
+  size_t size() const {
+    return values_.size();
+  }
+
+  size_t printTo(Print &out) override {
+    size_t written = out.write('[');
+    for (auto it = values_.begin(); it != values_.end(); ++it) {
+      if (it != values_.begin()) {
+        written += out.write(',');
+      }
+      written += (*it).printTo(out);
+    }
+    written += out.write(']');
+    return written;
+  }
+
+  size_t measureJson() override {
+    // Brackets, plus a comma between values.
+    size_t length = values_.empty() ? 2 : 1 + values_.size();
+    for (auto it = values_.begin(); it != values_.end(); ++it) {
+      length += (*it).measureJson();
+    }
+    return length;
+  }
+
+  bool operator==(const JsonArray &rhs) const {
+    return values_ == rhs.values_;
+  }
+
+  bool operator!=(const JsonArray &rhs) const {
+    return !(rhs == *this);
+  }
+};
+
+
+// An array of IDs kept as plain integers and written as the quoted strings the bridge uses for them, e.g. ["1","12"].
+// Instantiated for int and uint8_t, which JsonArray<int> and JsonArray<uint8_t> resolve to.
+template<typename Integer>
+class JsonIdArray : public JsonSerializable {
+  std::vector<Integer> values_;
+ public:
+  JsonIdArray() = default;
+  explicit JsonIdArray(int initial_capacity);
+
+  void add(Integer value);
+  template<typename Iterator>
+  void assign(Iterator first, Iterator last) {
+    values_.assign(first, last);
+  }
+  bool remove(Integer value);
+  bool contains(Integer value) const;
+  size_t size() const;
+  void clear();
+  size_t printTo(Print &out) override;
+  size_t measureJson() override;
+  bool operator==(const JsonIdArray &rhs) const;
+  bool operator!=(const JsonIdArray &rhs) const;
+};
+
+
+template<>
+class JsonArray<int> : public JsonIdArray<int> {
+ public:
+  using JsonIdArray<int>::JsonIdArray;
+};
+
+
+template<>
+class JsonArray<uint8_t> : public JsonIdArray<uint8_t> {
+ public:
+  using JsonIdArray<uint8_t>::JsonIdArray;
+};
+
+
+// A value that keeps its serialized form between changes, so that resending it unchanged costs no serialization.
+// Subclasses print through printValue() and measureValue(), and call markDirty() whenever their output changes.
+class JsonCachedSerializable : public JsonSerializable {
+ public:
+  // The serialized value, rebuilt only if it changed since the last call.
+  const String &serializedBody();
+  bool isDirty() const;
   String toJson() override;
-  bool operator==(const JsonArray &rhs) const;
-  bool operator!=(const JsonArray &rhs) const;
+  // Both go through serializedBody(), so measuring then printing a changed value serializes it once.
+  size_t printTo(Print &out) override;
+  size_t measureJson() override;
+
+ protected:
+  void markDirty();
+  // Called once per rebuild, before measureValue() and printValue().
+  virtual void prepare() {}
+  virtual size_t printValue(Print &out) = 0;
+  virtual size_t measureValue() = 0;
+
+ private:
+  String body_;
+  bool dirty_ = true;
+};
+
+
+// An object of scalar members stored inline, written out in the order they were first set. Keys are PROGMEM strings
+// that are neither copied nor allocated, and are matched by address; Setting a key again overwrites its value in
+// place, and only marks the object dirty if the value differs. String values are kept out of line, so that each
+// member is just its key, a tag and a union; Only they and the cached body can allocate.
+class JsonCompactObject : public JsonCachedSerializable {
+ public:
+  JsonCompactObject() = default;
+
+  // Each returns false if the object is full.
+  bool set(const char *key, bool value);
+  bool set(const char *key, int value);
+  bool set(const char *key, double value);
+  // Floats print only the digits they hold, e.g. 0.3227 rather than 0.32269999384880066.
+  bool set(const char *key, float value);
+  bool set(const char *key, const String &value);
+  // Each returns false if `key` is absent or holds another type.
+  bool get(const char *key, bool &value) const;
+  bool get(const char *key, int &value) const;
+  bool remove(const char *key);
+  bool has(const char *key) const;
+  uint8_t size() const;
+  void clear();
+  // Sets every member of `other` over this object's. Returns false if some didn't fit.
+  bool merge(const JsonCompactObject &other);
+
+ protected:
+  size_t printValue(Print &out) override;
+  size_t measureValue() override;
+
+ private:
+  enum Tag : uint8_t {
+    BOOL_VALUE,
+    INT_VALUE,
+    REAL_VALUE,
+    FLOAT_VALUE,
+    STRING_VALUE
+  };
+
+  struct Member {
+    const char *key;
+    Tag tag;
+    union {
+      bool bool_value;
+      int int_value;
+      double real_value;
+      float float_value;
+      // Into strings_.
+      uint8_t string_index;
+    };
+  };
+
+  Member members_[SPHUE_JSON_COMPACT_SIZE];
+  uint8_t size_ = 0;
+  // The values of STRING_VALUE members, in no particular order.
+  std::vector<String> strings_;
+
+  Member *find(const char *key);
+  Member *findOrAdd(const char *key);
+  // Gives `member` a tag of `tag`, releasing its string if it had one.
+  void retag(Member &member, Tag tag);
 };
 
 
-class JsonObject : public JsonSerializable {
+class JsonObject : public JsonCachedSerializable {
   std::map<String, std::unique_ptr<JsonSerializable>> values_;
  public:
   JsonObject() = default;
 
+  // `value` is copied.
   template<typename T>
-  void add(String &key, T &value);
+  void add(String &key, T &value) {
+    values_[key] = std::unique_ptr<JsonSerializable>(new T(value));
+    markDirty();
+  }
   void add(String &key, String &value);
   void add(String &key, bool value);
   void add(String &key, int value);
@@ -225,9 +665,12 @@ class JsonObject : public JsonSerializable {
   bool remove(String &key);
   bool has(String &key);
   int size();
-  String toJson() override;
   bool operator==(const JsonObject &rhs) const;
   bool operator!=(const JsonObject &rhs) const;
+
+ protected:
+  size_t printValue(Print &out) override;
+  size_t measureValue() override;
 };
 
 
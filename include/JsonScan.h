@@ -0,0 +1,213 @@
+#ifndef SPHUE_INCLUDE_JSONSCAN_H_
+#define SPHUE_INCLUDE_JSONSCAN_H_
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+
+// Scanners used by JsonParser to move through its read buffer. A byte-at-a-time loop is used unless a word-at-a-time
+// scanner is asked for: SPHUE_JSON_SCAN_SWAR picks 32-bit SWAR on any little-endian target, and SPHUE_JSON_SCAN_SIMD
+// picks AVX2 or SSE2 on x86. On recorded bridge payloads both measured slower than the byte loop on an x86-64 host
+// (see bench/), as strings there are short; They stay opt-in until a target shows a gain.
+//
+// Only string bodies and whitespace are scanned a word at a time. Outside of strings, bridge payloads have a
+// structural character every five bytes or so, and a plain loop finds the next one faster than loading a word.
+#if defined(SPHUE_JSON_SCAN_SWAR) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SPHUE_JSON_SCAN_IMPL_SWAR
+#elif defined(SPHUE_JSON_SCAN_SIMD) && defined(__AVX2__)
+#define SPHUE_JSON_SCAN_IMPL_AVX2
+#include <immintrin.h>
+#elif defined(SPHUE_JSON_SCAN_SIMD) && defined(__SSE2__)
+#define SPHUE_JSON_SCAN_IMPL_SSE2
+#include <emmintrin.h>
+#else
+#define SPHUE_JSON_SCAN_IMPL_SCALAR
+#endif
+
+namespace json {
+
+namespace scan {
+
+inline bool isStructural(const char c) {
+  switch (c) {
+    case '"':
+    case '\\':
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ',':
+    case ':':
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline bool isStringEnd(const char c) {
+  return c == '"' || c == '\\';
+}
+
+// JSON whitespace is space, tab, CR and LF. Every other byte at or below 0x20 is invalid outside a string, so
+// treating them all as whitespace keeps the word-at-a-time test to a single comparison.
+inline bool isWhitespace(const char c) {
+  return (unsigned char) c <= 0x20;
+}
+
+#if defined(SPHUE_JSON_SCAN_IMPL_SWAR)
+
+typedef uint32_t word_t;
+const word_t kOnes = (word_t) ~0 / 255;
+const word_t kHighs = kOnes * 0x80;
+
+// High bit set in each zero byte of `v`. Bytes above the first zero byte can be false positives, so only the lowest
+// flag is meaningful; That is all the scanners need.
+inline word_t zeroBytes(const word_t v) {
+  return (v - kOnes) & ~v & kHighs;
+}
+
+inline word_t matchBytes(const word_t v, const unsigned char c) {
+  return zeroBytes(v ^ (kOnes * c));
+}
+
+inline word_t stringEndBytes(const word_t v) {
+  return matchBytes(v, '"') | matchBytes(v, '\\');
+}
+
+inline word_t nonWhitespaceBytes(const word_t v) {
+  // High bit set in each byte above 0x20.
+  return ((v + kOnes * (0x7F - 0x20)) | v) & kHighs;
+}
+
+template<bool (*Match)(char), word_t (*MatchWord)(word_t)>
+inline const char *find(const char *p, const char *end) {
+  // Step up to a word boundary, then test a whole aligned word per iteration.
+  for (; p < end && ((uintptr_t) p & (sizeof(word_t) - 1)); ++p) {
+    if (Match(*p)) {
+      return p;
+    }
+  }
+  for (; end - p >= (ptrdiff_t) sizeof(word_t); p += sizeof(word_t)) {
+    word_t word;
+    memcpy(&word, __builtin_assume_aligned(p, sizeof(word_t)), sizeof(word_t));
+    const word_t found = MatchWord(word);
+    if (found) {
+      return p + (__builtin_ctz(found) >> 3);
+    }
+  }
+  for (; p < end; ++p) {
+    if (Match(*p)) {
+      return p;
+    }
+  }
+  return end;
+}
+
+inline bool isNotWhitespace(const char c) {
+  return !isWhitespace(c);
+}
+
+inline const char *findStringEnd(const char *p, const char *end) {
+  return find<isStringEnd, stringEndBytes>(p, end);
+}
+
+inline const char *skipWhitespace(const char *p, const char *end) {
+  return find<isNotWhitespace, nonWhitespaceBytes>(p, end);
+}
+
+#elif defined(SPHUE_JSON_SCAN_IMPL_SSE2) || defined(SPHUE_JSON_SCAN_IMPL_AVX2)
+
+#if defined(SPHUE_JSON_SCAN_IMPL_AVX2)
+typedef __m256i vector_t;
+#define SPHUE_SCAN_SET1 _mm256_set1_epi8
+#define SPHUE_SCAN_LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define SPHUE_SCAN_EQ _mm256_cmpeq_epi8
+#define SPHUE_SCAN_OR _mm256_or_si256
+#define SPHUE_SCAN_MAX _mm256_max_epu8
+#define SPHUE_SCAN_MASK(v) (uint32_t) _mm256_movemask_epi8(v)
+#else
+typedef __m128i vector_t;
+#define SPHUE_SCAN_SET1 _mm_set1_epi8
+#define SPHUE_SCAN_LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define SPHUE_SCAN_EQ _mm_cmpeq_epi8
+#define SPHUE_SCAN_OR _mm_or_si128
+#define SPHUE_SCAN_MAX _mm_max_epu8
+#define SPHUE_SCAN_MASK(v) (uint32_t) _mm_movemask_epi8(v)
+#endif
+
+inline uint32_t stringEndBytes(const vector_t v) {
+  return SPHUE_SCAN_MASK(SPHUE_SCAN_OR(SPHUE_SCAN_EQ(v, SPHUE_SCAN_SET1('"')), SPHUE_SCAN_EQ(v, SPHUE_SCAN_SET1('\\'))));
+}
+
+inline uint32_t nonWhitespaceBytes(const vector_t v) {
+  // A byte is at or below 0x20 when max(byte, 0x20) == 0x20.
+  const vector_t space = SPHUE_SCAN_SET1(0x20);
+  const uint32_t all = (sizeof(vector_t) == 32) ? 0xFFFFFFFF : 0xFFFF;
+  return ~SPHUE_SCAN_MASK(SPHUE_SCAN_EQ(SPHUE_SCAN_MAX(v, space), space)) & all;
+}
+
+inline bool isNotWhitespace(const char c) {
+  return !isWhitespace(c);
+}
+
+template<bool (*Match)(char), uint32_t (*MatchVector)(vector_t)>
+inline const char *find(const char *p, const char *end) {
+  for (; end - p >= (ptrdiff_t) sizeof(vector_t); p += sizeof(vector_t)) {
+    const uint32_t found = MatchVector(SPHUE_SCAN_LOAD(p));
+    if (found) {
+      return p + __builtin_ctz(found);
+    }
+  }
+  for (; p < end; ++p) {
+    if (Match(*p)) {
+      return p;
+    }
+  }
+  return end;
+}
+
+#undef SPHUE_SCAN_SET1
+#undef SPHUE_SCAN_LOAD
+#undef SPHUE_SCAN_EQ
+#undef SPHUE_SCAN_OR
+#undef SPHUE_SCAN_MAX
+#undef SPHUE_SCAN_MASK
+
+inline const char *findStringEnd(const char *p, const char *end) {
+  return find<isStringEnd, stringEndBytes>(p, end);
+}
+
+inline const char *skipWhitespace(const char *p, const char *end) {
+  return find<isNotWhitespace, nonWhitespaceBytes>(p, end);
+}
+
+#else
+
+inline const char *findStringEnd(const char *p, const char *end) {
+  while (p < end && !isStringEnd(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+inline const char *skipWhitespace(const char *p, const char *end) {
+  while (p < end && isWhitespace(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+#endif
+
+inline const char *findStructural(const char *p, const char *end) {
+  while (p < end && !isStructural(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+}
+
+}
+
+#endif //SPHUE_INCLUDE_JSONSCAN_H_
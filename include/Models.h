@@ -3,9 +3,13 @@
 
 #include <JSON.h>
 #include <vector>
+#include "Arena.h"
 
 namespace sphue {
 
+// Light and sensor IDs parsed from a response. Drawn from the Arena current when the list is created, if any.
+typedef std::vector<uint8_t, ArenaAllocator<uint8_t>> IdList;
+
 class NamedValue : public json::JsonModel {
  public:
   NamedValue() = default;
@@ -36,21 +40,21 @@ class NamedValue : public json::JsonModel {
 template<typename K, typename T>
 class ParsedMap : public json::JsonModel {
  public:
-  std::map<K, T> &operator*() {
+  // Map nodes are drawn from the Arena current when the map is created, if any.
+  typedef std::map<K, T, std::less<K>, ArenaAllocator<std::pair<const K, T>>> Map;
+  Map &operator*() {
     return values_;
   }
-  const std::map<K, T> &operator*() const {
+  const Map &operator*() const {
     return values_;
   }
  protected:
-  std::map<K, T> values_;
+  Map values_;
   virtual inline K getKey(String &from) = 0;
  private:
   bool onKey(String &key, json::JsonParser &parser) override {
-    T value;
-    bool success = parser.get(value);
-    values_[getKey(key)] = value;
-    return success;
+    // Parse straight into the map's node rather than copying a finished value in.
+    return parser.get(values_[getKey(key)]);
   }
 };
 
@@ -70,12 +74,64 @@ class ParsedStringMap : public ParsedMap<String, T> {
   }
 };
 
+// Parses a map of entities one at a time into a single scratch model, handing each to a callback instead of keeping
+// it. Memory use does not grow with the number of entities.
+template<typename K, typename T>
+class StreamedMap : public json::JsonModel {
+ public:
+  typedef std::function<void(const K &key, const T &value)> Callback;
+  explicit StreamedMap(const Callback &callback) : callback_(callback) {
+    //
+  }
+ protected:
+  virtual inline K getKey(String &from) = 0;
+ private:
+  Callback callback_;
+  T scratch_;
+  bool onKey(String &key, json::JsonParser &parser) override {
+    scratch_ = T();
+    bool success = parser.get(scratch_);
+    if (success) {
+      callback_(getKey(key), scratch_);
+    }
+    return success;
+  }
+};
+
+template<typename T>
+class StreamedIntMap : public StreamedMap<uint8_t, T> {
+ public:
+  explicit StreamedIntMap(const typename StreamedMap<uint8_t, T>::Callback &callback)
+      : StreamedMap<uint8_t, T>(callback) {
+    //
+  }
+ protected:
+  uint8_t getKey(String &from) override {
+    return from.toInt();
+  }
+};
+
+template<typename T>
+class StreamedStringMap : public StreamedMap<String, T> {
+ public:
+  explicit StreamedStringMap(const typename StreamedMap<String, T>::Callback &callback)
+      : StreamedMap<String, T>(callback) {
+    //
+  }
+ protected:
+  String getKey(String &from) override {
+    return from;
+  }
+};
+
+// build() runs once each time the body is rebuilt, i.e. after the object was dirtied; Members it reads that aren't set
+// through T must call markDirty().
 template<typename T = json::JsonObject>
 class BuildableObject : public T {
- public:
-  String toJson() override {
+ protected:
+  void prepare() override {
+    T::prepare();
     build();
-    return T::toJson();
   }
  private:
   virtual void build() = 0;
@@ -88,7 +144,8 @@ class DiscoveryResponse : public json::JsonModel {
  private:
   String id_;
   String ip_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 class RegisterResponse : public json::JsonModel {
@@ -96,7 +153,8 @@ class RegisterResponse : public json::JsonModel {
   const String &username() const;
  private:
   String username_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 // TODO: Consider adding build flags for extended model fields, ie IFDEF SPHUE_RESPONSE_EXTENDED
@@ -123,7 +181,8 @@ class State : public json::JsonModel {
   uint8_t sat_;
   uint16_t ct_;
   bool reachable_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 // struct swupdate {} // needed?
@@ -147,7 +206,8 @@ class Light : public json::JsonModel {
   State state_;
   String name_;
   String uniqueid_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 typedef ParsedIntMap<Light> Lights;
@@ -162,13 +222,17 @@ class NewLights : public ParsedIntMap<String> {
   bool onKey(String &key, json::JsonParser &parser) override;
 };
 
-class LightStateChange : public json::JsonObject {
+class LightStateChange : public json::JsonCompactObject {
   // The following fields have been omitted for simplicity. They can be added in later if desired. //
   // float xy[2];
   // float xy_inc[2];
   // String alert;
   // String effect;
  public:
+  // Distinct keys the setters can add: a value, an increment and a decrement for each of bri, sat, hue and ct, plus on
+  // and transitiontime.
+  static constexpr uint8_t kMaxFields = 14;
+
   void setOn(bool turned_on);
   void setBrightness(uint8_t brightness);
   void setHue(uint16_t hue);
@@ -183,6 +247,115 @@ class LightStateChange : public json::JsonObject {
   void decrementHue(uint16_t hue_decrement);
   void incrementColorTemp(uint16_t color_temp_increment);
   void decrementColorTemp(uint16_t color_temp_decrement);
+  // Applies a later change on top of this one, so that sending the result has the effect of sending both in turn.
+  // Fields are overwritten, except for increments and decrements, which add up or are folded into a value set here.
+  // Returns false if some field didn't fit.
+  bool merge(const LightStateChange &newer);
+};
+
+namespace state_fields {
+// Key, widest value and range of each StateChangeBuilder field, indexed by StateChangeBuilder::Field. The range is
+// what the field's setter can produce.
+struct Spec {
+  const char *key;
+  uint8_t max_value_length;
+  int32_t min;
+  int32_t max;
+};
+
+constexpr Spec table[] = {
+    {"on", 5, 0, 1},
+    {"bri", 3, 0, UINT8_MAX},
+    {"hue", 5, 0, UINT16_MAX},
+    {"sat", 3, 0, UINT8_MAX},
+    {"ct", 5, 0, UINT16_MAX},
+    {"transitiontime", 5, 0, UINT16_MAX},
+    {"bri_inc", 4, -254, 254},
+    {"sat_inc", 4, -254, 254},
+    {"hue_inc", 6, -65534, 65534},
+    {"ct_inc", 6, -65534, 65534},
+};
+
+constexpr size_t keyLength(const char *key) {
+  return *key ? 1 + keyLength(key + 1) : 0;
+}
+
+// `"key":value,` for every field, plus braces and the terminating NUL.
+constexpr size_t maxJsonSize(size_t field = 0) {
+  return (field == sizeof(table) / sizeof(table[0]))
+         ? 3 : keyLength(table[field].key) + 4 + table[field].max_value_length + maxJsonSize(field + 1);
+}
+}
+
+// A light, group or scene state change limited to a fixed set of fields, kept as plain members with a presence mask.
+// It serializes into a caller-provided buffer of kMaxJsonSize bytes and never allocates.
+class StateChangeBuilder {
+ public:
+  enum Field : uint8_t {
+    ON,
+    BRI,
+    HUE,
+    SAT,
+    CT,
+    TRANSITIONTIME,
+    BRI_INC,
+    SAT_INC,
+    HUE_INC,
+    CT_INC,
+    FIELD_COUNT
+  };
+  static constexpr size_t kMaxJsonSize = state_fields::maxJsonSize();
+  static constexpr uint8_t kNoSlot = 0xFF;
+
+  void setOn(bool turned_on);
+  void setBrightness(uint8_t brightness);
+  void setHue(uint16_t hue);
+  void setSaturation(uint8_t saturation);
+  void setColorTemp(uint16_t color_temp);
+  void setTransitionTime(uint16_t time_in_tenths_of_seconds);
+  // Negative values decrement. Deltas are clamped to the range the bridge accepts.
+  void incrementBrightness(int16_t brightness_increment);
+  void incrementSaturation(int16_t saturation_increment);
+  void incrementHue(int32_t hue_increment);
+  void incrementColorTemp(int32_t color_temp_increment);
+
+  // Copies the fields of `change`, clamped as by the setters. Returns false if `change` holds a field this class does
+  // not support, such as a scene.
+  bool assign(const LightStateChange &change);
+
+  bool has(Field field) const;
+  uint8_t size() const;
+  void clear();
+
+  // Writes the JSON object and a terminating NUL to `dest`. Returns its length, or 0 if `size` is below kMaxJsonSize.
+  size_t serialize(char *dest, size_t size) const;
+  template<size_t N>
+  size_t serialize(char (&dest)[N]) const {
+    static_assert(N >= kMaxJsonSize, "Buffer is smaller than StateChangeBuilder::kMaxJsonSize");
+    return serialize(dest, N);
+  }
+  // As above, but pads every value with leading spaces to its widest length and stores where each field's value
+  // starts in `slots` (kNoSlot if absent), so that values can be rewritten in place with writeSlot().
+  size_t serialize(char *dest, size_t size, uint8_t (&slots)[FIELD_COUNT]) const;
+  // Writes `value` right-aligned in a slot of the field's widest length. Returns false if it is too wide.
+  static bool writeSlot(char *dest, Field field, long value);
+
+ private:
+  uint16_t fields_ = 0;
+  bool on_ = false;
+  uint8_t bri_ = 0;
+  uint16_t hue_ = 0;
+  uint8_t sat_ = 0;
+  uint16_t ct_ = 0;
+  uint16_t transitiontime_ = 0;
+  int16_t bri_inc_ = 0;
+  int16_t sat_inc_ = 0;
+  int32_t hue_inc_ = 0;
+  int32_t ct_inc_ = 0;
+
+  void mark(Field field);
+  long value(Field field) const;
+  size_t write(char *dest, uint8_t *slots) const;
 };
 
 class Group : public json::JsonModel {
@@ -244,36 +417,41 @@ class Group : public json::JsonModel {
   static Class classFromString(String &string) ICACHE_FLASH_ATTR;
   static String classToString(Class &a_class) ICACHE_FLASH_ATTR;
   const String &name() const;
-  const std::vector<uint8_t> &lights() const;
-  const std::vector<uint8_t> &sensors() const;
+  const IdList &lights() const;
+  const IdList &sensors() const;
   bool allOn() const;
   bool anyOn() const;
   bool recycle() const;
   const State &action() const;
  private:
   String name_;
-  std::vector<uint8_t> lights_;
-  std::vector<uint8_t> sensors_;
+  IdList lights_;
+  IdList sensors_;
   Type type_;
   bool all_on_;
   bool any_on_;
   bool recycle_;
   Class class_;
   State action_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 typedef ParsedIntMap<Group> Groups;
 
 class GroupAttributeChange : public BuildableObject<> {
  public:
-  void addLight(int light_id);
-  void removeLight(int light_id);
+  // IDs are kept as in an IdList; Returns false, leaving the lights as they were, if `light_id` is outside 0-255.
+  bool addLight(int light_id);
+  // Returns false if `light_id` wasn't added.
+  bool removeLight(int light_id);
+  // Replaces the lights added so far.
+  void setLights(const IdList &light_ids);
   void setName(String &name);
   virtual void setRoomClass(Group::Class a_class);
   void build() override;
  private:
-  json::JsonArray<json::JsonString> lights_;
+  json::JsonArray<uint8_t> lights_;
 };
 
 class GroupCreationRequest : public GroupAttributeChange {
@@ -284,9 +462,16 @@ class GroupCreationRequest : public GroupAttributeChange {
 
 class GroupStateChange : public LightStateChange {
  public:
+  // The light state keys plus scene.
+  static constexpr uint8_t kMaxFields = LightStateChange::kMaxFields + 1;
+
   void setScene(String &scene);
 };
 
+// Every key a change can set has a member, so no setter or merge() ever drops a field.
+static_assert(SPHUE_JSON_COMPACT_SIZE >= GroupStateChange::kMaxFields,
+              "SPHUE_JSON_COMPACT_SIZE is smaller than the keys of a GroupStateChange");
+
 class Scene : public json::JsonModel {
   // The following fields have been omitted for simplicity. They can be added in later if desired. //
   // String owner_;
@@ -305,17 +490,18 @@ class Scene : public json::JsonModel {
   const String &name() const;
   Type type() const;
   uint8_t group() const;
-  const std::vector<uint8_t> &lights() const;
+  const IdList &lights() const;
   bool recycle() const;
   bool locked() const;
  private:
   String name_;
   Type type_;
   uint8_t group_;
-  std::vector<uint8_t> lights_;
+  IdList lights_;
   bool recycle_;
   bool locked_;
-  bool onKey(String &key, json::JsonParser &parser) override;
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
 };
 
 typedef ParsedStringMap<Scene> Scenes;
@@ -327,17 +513,21 @@ class SceneModificationRequest : public json::JsonObject {};
 
 class SceneAttributeChange : public BuildableObject<SceneModificationRequest> {
  public:
-  void addLight(int light_id);
-  void removeLight(int light_id);
+  // IDs are kept as in an IdList; Returns false, leaving the lights as they were, if `light_id` is outside 0-255.
+  bool addLight(int light_id);
+  // Returns false if `light_id` wasn't added.
+  bool removeLight(int light_id);
+  // Replaces the lights added so far.
+  void setLights(const IdList &light_ids);
   void setName(String &name);
   // TODO: "lightstates": {"#":{lightstate_object}, ...}
   void setStoreLightState(bool store_light_state);
   void build() override;
  private:
-  json::JsonArray<json::JsonString> lights_;
+  json::JsonArray<uint8_t> lights_;
 };
 
-class SceneStateChange : public SceneModificationRequest {
+class SceneStateChange : public json::JsonCompactObject {
   // The following fields have been omitted for simplicity. They can be added in later if desired. //
   // float xy[2];
   // String effect;
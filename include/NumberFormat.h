@@ -0,0 +1,30 @@
+#ifndef SPHUE_INCLUDE_NUMBERFORMAT_H_
+#define SPHUE_INCLUDE_NUMBERFORMAT_H_
+
+#include <Arduino.h>
+#include <stddef.h>
+
+// Digits printed for reals by JsonNumber and JsonCompactObject. Negative (default) prints the shortest form that reads
+// back as the same value; Otherwise values are rounded to this many decimals, e.g. 4 for CIE xy coordinates.
+#ifndef SPHUE_JSON_REAL_PRECISION
+#define SPHUE_JSON_REAL_PRECISION -1
+#endif
+
+// Buffer sizes formatInteger() and formatReal() need; Neither terminates its output.
+#define SPHUE_FORMAT_INTEGER_SIZE 11
+#define SPHUE_FORMAT_REAL_SIZE 26
+
+namespace json {
+
+// Writes `value` in decimal. Returns the number of characters written.
+size_t formatInteger(char *buffer, int32_t value);
+
+// Writes `value` as a JSON number, in exponent form for very large or small magnitudes. With a negative `precision`,
+// prints the shortest digits that read back as `value` (Grisu2), treating it as a float when `single` is set so that
+// floats don't print the noise of their conversion to double. Otherwise rounds to `precision` decimals (up to 9) and
+// drops trailing zeros. NaN and infinity are not representable in JSON and print as null.
+size_t formatReal(char *buffer, double value, int8_t precision = -1, bool single = false);
+
+}
+
+#endif //SPHUE_INCLUDE_NUMBERFORMAT_H_
@@ -0,0 +1,111 @@
+#ifndef SPHUE_INCLUDE_SCHEDULER_H_
+#define SPHUE_INCLUDE_SCHEDULER_H_
+
+#include "Sphue.h"
+#include <deque>
+
+// Commands a Scheduler holds before its Policy applies.
+#ifndef SPHUE_SCHEDULER_CAPACITY
+#define SPHUE_SCHEDULER_CAPACITY 16
+#endif
+
+// The bridge handles about 10 light commands and 1 group command per second.
+#ifndef SPHUE_SCHEDULER_LIGHT_RATE
+#define SPHUE_SCHEDULER_LIGHT_RATE 10
+#endif
+#ifndef SPHUE_SCHEDULER_GROUP_RATE
+#define SPHUE_SCHEDULER_GROUP_RATE 1
+#endif
+
+namespace sphue {
+
+// Allows `rate` events per second on average, in bursts of up to `burst`. A rate of zero allows every event.
+class TokenBucket {
+ public:
+  TokenBucket(uint16_t rate, uint8_t burst);
+
+  void configure(uint16_t rate, uint8_t burst);
+  // Whether a token is available; take() uses it up.
+  bool ready();
+  bool take();
+
+ private:
+  // In thousandths of a token, so that a rate in tokens per second refills by `rate` each millisecond.
+  uint32_t tokens_;
+  uint32_t capacity_;
+  uint16_t rate_;
+  unsigned long refilled_;
+
+  void refill();
+};
+
+
+// Paces light and group state changes to what the bridge can take. Changes are queued as they come and sent from
+// poll(), one at a time through Sphue's asynchronous calls, as the token bucket of their class allows. With COALESCE, a
+// change for a light or group that already has a command waiting is merged into that command (see
+// LightStateChange::merge()) instead of queued behind it, so a dimmer knob turned for a second sends one body with the
+// latest brightness rather than dozens. The queue is bounded, which bounds how stale a command can get before it is
+// sent; When it is full, the oldest command is dropped. A scheduler must outlive any command it has in flight.
+class Scheduler {
+ public:
+  enum Policy : uint8_t {
+    DROP_OLDEST,
+    COALESCE
+  };
+
+  struct Counters {
+    // Changes accepted.
+    uint32_t queued = 0;
+    // Commands sent, and those of them the bridge did not fully accept.
+    uint32_t sent = 0;
+    uint32_t failed = 0;
+    // Commands dropped unsent, and changes merged into a queued command.
+    uint32_t dropped = 0;
+    uint32_t coalesced = 0;
+  };
+
+  explicit Scheduler(Sphue &sphue, Policy policy = COALESCE, uint8_t capacity = SPHUE_SCHEDULER_CAPACITY);
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // Rates are in commands per second; Zero sends commands of that class as fast as the bridge answers them, one at a
+  // time. A burst of zero is taken as one.
+  void setLightRate(uint16_t rate, uint8_t burst = 1);
+  void setGroupRate(uint16_t rate, uint8_t burst = 1);
+
+  // `change` is copied.
+  void setLightState(int id, const LightStateChange &change);
+  void setGroupState(int id, const GroupStateChange &change);
+
+  // Call from loop(), in place of Sphue::poll(). Sends the next command the rate limits allow once the last one is done.
+  void poll();
+
+  const Counters &counters() const;
+  // Commands waiting to be sent.
+  size_t size() const;
+
+ private:
+  struct Command {
+    bool group;
+    int id;
+    GroupStateChange change;
+  };
+
+  Sphue &sphue_;
+  std::deque<Command> queue_;
+  TokenBucket lights_;
+  TokenBucket groups_;
+  Counters counters_;
+  Policy policy_;
+  uint8_t capacity_;
+  // Whether a command is waiting on its response.
+  bool busy_ = false;
+
+  void queue(bool group, int id, const LightStateChange &change);
+  bool coalesce(bool group, int id, const LightStateChange &change);
+  void sendNext();
+};
+
+}
+
+#endif //SPHUE_INCLUDE_SCHEDULER_H_
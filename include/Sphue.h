@@ -2,11 +2,21 @@
 #define SPHUE_INCLUDE_SPHUE_H_
 
 #include "Models.h"
+#include "Http.h"
 #include <Rested.h>
 #include "PgmStringTools.hpp"
+#include <deque>
 
 #define SPHUE_APP_NAME        "Sphue"
 
+// How long Sphue::poll() runs for at most, and how long an asynchronous call waits for its response; In milliseconds.
+#ifndef SPHUE_POLL_SLICE
+#define SPHUE_POLL_SLICE 5
+#endif
+#ifndef SPHUE_ASYNC_TIMEOUT
+#define SPHUE_ASYNC_TIMEOUT 5000
+#endif
+
 namespace sphue {
 
 namespace strings {
@@ -19,6 +29,11 @@ const char key_address[] PROGMEM = "address";
 const char key_description[] PROGMEM = "description";
 }
 
+// Response keys in ascending order; ResponseField values index into this table.
+MAKE_KEY_TABLE(response_keys, strings::key_address, strings::key_description, strings::key_error,
+               strings::key_success, strings::key_type)
+enum ResponseField : uint8_t { RESPONSE_ADDRESS, RESPONSE_DESCRIPTION, RESPONSE_ERROR, RESPONSE_SUCCESS, RESPONSE_TYPE };
+
 namespace ResultCode {
 const uint16_t UNKNOWN                          = 0;
 const uint16_t UNAUTHORIZED                     = 1;
@@ -97,7 +112,15 @@ class Response : public json::JsonModel {
     return error_description_;
   }
 
+  // The arena the result was parsed into, when Sphue::setArenaSize() is in use. The arena is released once the response
+  // and every container moved or copied out of it are gone.
+  const Arena *arena() const {
+    return arena_.get();
+  }
+
  private:
+  // Declared ahead of result_ so that the result is destroyed before its arena.
+  std::shared_ptr<Arena> arena_;
   uint16_t result_code_ = ResultCode::UNKNOWN;
   String error_address_;
   String error_description_;
@@ -107,17 +130,124 @@ class Response : public json::JsonModel {
     //
   }
 
-  bool onKey(String &key, json::JsonParser &parser) override {
-    STR_EQ_INIT(key.c_str())
-    STR_EQ_RET(strings::key_success, parser.get(result_))
-    STR_EQ_RET(strings::key_error, parser.get(*this))
-    STR_EQ_RET(strings::key_type, parser.get(result_code_))
-    STR_EQ_RET(strings::key_address, parser.get(error_address_))
-    STR_EQ_RET(strings::key_description, parser.get(error_description_))
-    return false;
+  const json::JsonKeyTable *keyTable() const override {
+    return &response_keys;
+  }
+
+  bool onField(uint8_t field, json::JsonParser &parser) override {
+    switch (field) {
+      case RESPONSE_SUCCESS:
+        if (!parser.get(result_)) {
+          return false;
+        }
+        result_code_ = ResultCode::OK;
+        return true;
+      case RESPONSE_ERROR:
+        return parser.get(*this);
+      case RESPONSE_TYPE:
+        return parser.get(result_code_);
+      case RESPONSE_ADDRESS:
+        return parser.get(error_address_);
+      case RESPONSE_DESCRIPTION:
+        return parser.get(error_description_);
+      default:
+        return false;
+    }
   }
 };
 
+// The outcome of a change that sets several fields at once, for callers that only need to know whether it succeeded.
+// Unlike the std::vector<Response<NamedValue>> results, nothing is kept of the values the bridge echoes back; Only a
+// bit per response entry, the first error code and, if asked for, the address of that error.
+class ResultSummary : public json::JsonModel {
+  friend class Sphue;
+
+ public:
+  // With `keep_error_address` set, the address of the first error is kept, e.g. "/lights/1/state/bri".
+  explicit ResultSummary(bool keep_error_address = false);
+
+  // Bit i is set if the i-th entry of the response was a success. Entries past the 32nd are counted but not recorded.
+  uint32_t successes() const;
+  // The number of entries in the response.
+  uint8_t count() const;
+  // The type of the first error, or ResultCode::OK if there was none.
+  uint16_t firstError() const;
+  const String &errorAddress() const;
+
+  // True if the bridge accepted every field of the change.
+  explicit operator bool() const;
+
+ private:
+  uint32_t successes_ = 0;
+  uint8_t count_ = 0;
+  uint8_t expected_ = 0;
+  uint16_t first_error_ = ResultCode::OK;
+  bool keep_error_address_;
+  bool in_error_ = false;
+  String error_address_;
+
+  void read(Stream &response_stream, uint8_t expected);
+  void fail(uint8_t expected);
+  // Summarizing an entry at a time; Entries are recorded between begin() and end(), each followed by next().
+  void begin(uint8_t expected);
+  void next();
+  void end();
+
+  const json::JsonKeyTable *keyTable() const override;
+  bool onField(uint8_t field, json::JsonParser &parser) override;
+};
+
+// A request path formatted into a fixed buffer, e.g. /api/<key>/lights/12/state. Segments that don't fit are dropped
+// rather than overflowing.
+class Path {
+ public:
+  static constexpr size_t kSize = 96;
+
+  Path(const char *prefix, size_t length);
+
+  // Each appends "/<segment>". Collection names are PROGMEM strings.
+  Path &collection(const char *name);
+  Path &id(int id);
+  Path &leaf(const char *name);
+
+  const char *c_str() const;
+  size_t length() const;
+
+ private:
+  char value_[kSize];
+  size_t length_;
+
+  char *reserve(size_t length);
+};
+
+// A light or group state change built once for repeated sending, e.g. from a dimmer knob or color wheel. The path and
+// body are prepared up front with each value padded to its widest length; set() rewrites a value in place and
+// Sphue::send() writes the bytes as they are. Nothing is serialized per send, and nothing is allocated once
+// Sphue::setClient() has been called.
+class PreparedCommand {
+  friend class Sphue;
+
+ public:
+  // Replaces the value of a field the command was prepared with. Returns false, leaving the command as it was, if it
+  // has no such field or `value` is outside what the field's StateChangeBuilder setter takes (deltas as clamped).
+  bool set(StateChangeBuilder::Field field, long value);
+  bool setOn(bool turned_on);
+
+  const char *path() const;
+  const char *body() const;
+  size_t length() const;
+
+  // False if the command could not be prepared.
+  explicit operator bool() const;
+
+ private:
+  char path_[Path::kSize];
+  char body_[StateChangeBuilder::kMaxJsonSize];
+  uint8_t slots_[StateChangeBuilder::FIELD_COUNT];
+  size_t length_ = 0;
+  uint8_t fields_ = 0;
+};
+
 class Sphue {
  public:
   explicit Sphue(const char *apiKey, const char *hostname, int port = 80);
@@ -129,6 +259,16 @@ class Sphue {
   void setInsecure();
   void setRequireSelfSignedCert(bool require_self_signed_cert);
   void setSslFingerprint(const char *fingerprint);
+  // When non-zero, each response returned by the get*() calls is parsed into its own arena of `size` bytes, released
+  // in one go when the response is destroyed. Check Response::arena()->peak() to size it. Zero (default) disables.
+  void setArenaSize(size_t size);
+  // Sends requests (other than registerDeviceApiKey()) through `client` over plain HTTP, on one connection kept open
+  // between calls. Change objects are sent from their cached serializedBody(). The bridge serves its API on port 80 as
+  // well as 443.
+  void setClient(Client &client);
+  // How long, in milliseconds, the connection opened through setClient() is kept idle for the next call. Defaults to
+  // SPHUE_HTTP_IDLE_TIMEOUT; Zero closes it after every call.
+  void setIdleTimeout(unsigned long timeout);
 
   // Lights API
   Response<Lights> getAllLights();
@@ -137,6 +277,15 @@ class Sphue {
   Response<Light> getLight(int id);
   Response<NamedValue> renameLight(int id, String &new_name);
   std::vector<Response<NamedValue>> setLightState(int id, LightStateChange &change);
+  // The ResultSummary overloads report into `summary` instead and return true if the bridge accepted every field.
+  bool setLightState(int id, LightStateChange &change, ResultSummary &summary);
+  // Returns true if the bridge accepted every field. Makes no heap allocations once setClient() has been called.
+  bool setLightState(int id, const StateChangeBuilder &change);
+  // Sets the state of several lights at once, e.g. a room. Once setClient() has been called, up to
+  // SPHUE_HTTP_PIPELINE_DEPTH requests are written ahead on the kept connection before their responses are read, so the
+  // batch takes about one round trip rather than one per light. Results are in the order of `changes`. Requests lost
+  // to a closed connection are sent again; Once one goes unanswered on an open one, it and the rest fail.
+  std::vector<ResultSummary> setLightStates(const std::vector<std::pair<int, LightStateChange *>> &changes);
   Response<String> deleteLight(int id);
 
   // Groups API
@@ -144,7 +293,10 @@ class Sphue {
   Response<NamedValue> createGroup(GroupCreationRequest &request);
   Response<Group> getGroup(int id);
   std::vector<Response<NamedValue>> setGroupAttributes(int id, GroupAttributeChange &change);
+  bool setGroupAttributes(int id, GroupAttributeChange &change, ResultSummary &summary);
   std::vector<Response<NamedValue>> setGroupState(int id, GroupStateChange &change);
+  bool setGroupState(int id, GroupStateChange &change, ResultSummary &summary);
+  bool setGroupState(int id, const StateChangeBuilder &change);
   Response<String> deleteGroup(int id);
 
   // Scenes API
@@ -152,8 +304,57 @@ class Sphue {
   Response<NamedValue> createScene(SceneCreationRequest &request);
   Response<Scene> getScene(int id);
   std::vector<Response<NamedValue>> modifyScene(int id, SceneModificationRequest &change);
+  std::vector<Response<NamedValue>> modifyScene(int id, SceneStateChange &change);
+  bool modifyScene(int id, SceneModificationRequest &change, ResultSummary &summary);
+  bool modifyScene(int id, SceneStateChange &change, ResultSummary &summary);
   Response<String> deleteScene(int id);
 
+  // Prepared commands; See PreparedCommand. Changes holding fields StateChangeBuilder doesn't support, such as a scene,
+  // give a command that evaluates to false.
+  PreparedCommand prepareLightState(int id, const StateChangeBuilder &change);
+  PreparedCommand prepareLightState(int id, const LightStateChange &change);
+  PreparedCommand prepareGroupState(int id, const StateChangeBuilder &change);
+  PreparedCommand prepareGroupState(int id, const GroupStateChange &change);
+  // Returns true if the bridge accepted every field.
+  bool send(const PreparedCommand &command);
+
+  // Asynchronous calls; Each is queued and returns at once, and `callback` is called from poll() with the result. Calls
+  // are made one at a time, in order, on the connection opened through setClient(); Without one, they fail. Blocking
+  // calls share that connection, so avoid them while asynchronous ones are outstanding. State change results are
+  // summarized as they arrive; Other responses are kept whole until parsed, and fail the call past
+  // SPHUE_ASYNC_MAX_BODY bytes. Read large collections, such as the scenes of a busy bridge, with forEachScene().
+  template<typename T>
+  using Callback = std::function<void(Response<T> &response)>;
+  typedef std::function<void(const ResultSummary &summary)> SummaryCallback;
+  void getAllLightsAsync(const Callback<Lights> &callback);
+  void getLightAsync(int id, const Callback<Light> &callback);
+  void setLightStateAsync(int id, LightStateChange &change, const SummaryCallback &callback);
+  void getAllGroupsAsync(const Callback<Groups> &callback);
+  void getGroupAsync(int id, const Callback<Group> &callback);
+  void setGroupStateAsync(int id, GroupStateChange &change, const SummaryCallback &callback);
+  void getAllScenesAsync(const Callback<Scenes> &callback);
+  void getSceneAsync(int id, const Callback<Scene> &callback);
+  // Call from loop(). Sends the next queued request, reads whatever has arrived of its response and, once that is
+  // complete, parses it and calls back; Returning after `slice` ms, or as soon as it would have to wait on the bridge.
+  // Opening a new connection and parsing a complete response are not split up. Returns the number of calls left.
+  size_t poll(unsigned long slice = SPHUE_POLL_SLICE);
+
+  // Streamed reads; Entities are parsed one at a time into a single scratch model and handed to `callback`.
+  bool forEachLight(const StreamedIntMap<Light>::Callback &callback);
+  bool forEachGroup(const StreamedIntMap<Group>::Callback &callback);
+  bool forEachScene(const StreamedStringMap<Scene>::Callback &callback);
+
+  // Event-driven reads; The body of getAllLights(), getAllGroups() or getAllScenes() is reported to `handler`.
+  bool streamLights(json::JsonHandler &handler);
+  bool streamGroups(json::JsonHandler &handler);
+  bool streamScenes(json::JsonHandler &handler);
+
+  // Partial reads; `paths` are projected over the body of getAllLights(), getAllGroups() or getAllScenes() and only
+  // matching values are handed to `callback`, e.g. "/*/state/on" or "/*/name".
+  bool projectLights(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback);
+  bool projectGroups(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback);
+  bool projectScenes(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback);
+
   // Configuration API
   Response<RegisterResponse> registerDeviceApiKey(const char *deviceName, const char *applicationName = SPHUE_APP_NAME);
 
@@ -171,7 +372,21 @@ class Sphue {
  private:
   // TODO: Is StreamedSecureRestClient suitable for HTTP (non-SSL) hosts?
   rested::StreamedSecureRestClient client_;
-  const char *apiKey_;
+  const char *apiKey_ = nullptr;
+  // "/api/<key>", formatted by setApiKey(). Bridge keys are 40 characters.
+  char prefix_[64] = "/api";
+  uint8_t prefix_length_ = 4;
+  size_t arena_size_ = 0;
+  unsigned long idle_timeout_ = SPHUE_HTTP_IDLE_TIMEOUT;
+  String hostname_;
+  int port_;
+  std::shared_ptr<http::Connection> connection_;
+  // Asynchronous calls, defined in Sphue.cpp.
+  class Call;
+  template<typename T>
+  class ResponseCall;
+  class SummaryCall;
+  std::deque<std::shared_ptr<Call>> calls_;
 
   template<typename T>
   bool parseSingleResponse(Stream &response_stream, Response<T> &dest);
@@ -180,22 +395,30 @@ class Sphue {
   template<typename T>
   std::vector<Response<T>> parseResponses(Stream &response_stream, int size = 0);
 
-  String buildEndpoint(std::stringstream &string_builder);
-  template<typename T, typename... Args>
-  String buildEndpoint(std::stringstream &string_builder, T &value, Args&... args);
-  template<typename... Args>
-  String makeEndpoint(Args&... args);
-
-  template<typename T, typename... Endpoint>
-  Response<T> get(Endpoint... args);
-  template<typename T, typename... Endpoint>
-  Response<T> post(json::JsonObject *body, Endpoint... args);
-  template<typename... Endpoint>
-  std::vector<Response<NamedValue>> post(json::JsonObject *body, Endpoint... args);
-  template<typename... Endpoint>
-  std::vector<Response<NamedValue>> put(json::JsonObject *body, Endpoint... args);
-  template<typename... Endpoint>
-  Response<String> del(Endpoint... args);
+  // The path of a collection, or of one of its entities and optionally a leaf below that, under the API key.
+  Path endpoint(const char *collection) const;
+  Path endpoint(const char *collection, const char *leaf) const;
+  Path endpoint(const char *collection, int id, const char *leaf = nullptr) const;
+
+  template<typename T>
+  Response<T> get(const Path &path);
+  template<typename T>
+  bool forEach(T &model, const Path &path);
+  bool stream(json::JsonHandler &handler, const Path &path);
+  bool project(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback, const Path &path);
+  bool putState(const Path &path, const StateChangeBuilder &change);
+  PreparedCommand prepareState(const Path &path, const StateChangeBuilder &change);
+  void queue(Call *call);
+  bool putBody(const char *path, const char *body, size_t length, uint8_t fields);
+  bool sendBody(const char *method, const char *path, const char *body, size_t length, uint8_t fields,
+                ResultSummary &summary);
+  template<typename T>
+  Response<T> post(json::JsonSerializable *body, const Path &path);
+  template<typename Body>
+  std::vector<Response<NamedValue>> post(Body *body, const Path &path);
+  template<typename Body>
+  std::vector<Response<NamedValue>> put(Body *body, const Path &path);
+  Response<String> del(const Path &path);
 };
 
 Sphue autoDiscoverHub(const char *hubId = nullptr);
@@ -0,0 +1,88 @@
+#include "Arena.h"
+
+namespace sphue {
+
+const std::shared_ptr<Arena> *Arena::current_ = nullptr;
+
+
+////////////////////////////////////////////////////////////////
+// Class : Arena ///////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+Arena::Arena(size_t size) : block_((char *) malloc(size)), size_(block_ ? size : 0) {
+  //
+}
+
+
+Arena::~Arena() {
+  free(block_);
+}
+
+
+void *Arena::allocate(size_t size, size_t align) {
+  size_t start = (used_ + align - 1) & ~(align - 1);
+  if (start + size > size_ || start + size < start) {
+    overflow_ += size;
+    return nullptr;
+  }
+  used_ = start + size;
+  if (used_ > peak_) {
+    peak_ = used_;
+  }
+  return block_ + start;
+}
+
+
+void Arena::deallocate(void *ptr, size_t size) {
+  if ((char *) ptr + size == block_ + used_) {
+    used_ -= size;
+  }
+}
+
+
+bool Arena::owns(const void *ptr) const {
+  return (const char *) ptr >= block_ && (const char *) ptr < block_ + size_;
+}
+
+
+size_t Arena::size() const {
+  return size_;
+}
+
+
+size_t Arena::used() const {
+  return used_;
+}
+
+
+size_t Arena::peak() const {
+  return peak_;
+}
+
+
+size_t Arena::overflow() const {
+  return overflow_;
+}
+
+
+std::shared_ptr<Arena> Arena::current() {
+  return current_ ? *current_ : std::shared_ptr<Arena>();
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : ArenaScope //////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+ArenaScope::ArenaScope(std::shared_ptr<Arena> arena) : arena_(std::move(arena)), previous_(Arena::current_) {
+  if (arena_) {
+    Arena::current_ = &arena_;
+  }
+}
+
+
+ArenaScope::~ArenaScope() {
+  Arena::current_ = previous_;
+}
+
+}
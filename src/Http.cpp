@@ -0,0 +1,618 @@
+#include "Http.h"
+
+namespace http {
+
+////////////////////////////////////////////////////////////////
+// Class : BufferedPrint ///////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+BufferedPrint::BufferedPrint(Print &out) : out_(out) {
+  //
+}
+
+
+BufferedPrint::~BufferedPrint() {
+  flush();
+}
+
+
+size_t BufferedPrint::write(uint8_t c) {
+  if (length_ == sizeof(buffer_)) {
+    flush();
+  }
+  buffer_[length_++] = c;
+  return 1;
+}
+
+
+size_t BufferedPrint::write(const uint8_t *buffer, size_t size) {
+  if (length_ + size > sizeof(buffer_)) {
+    flush();
+    if (size > sizeof(buffer_)) {
+      return out_.write(buffer, size);
+    }
+  }
+  memcpy(buffer_ + length_, buffer, size);
+  length_ += size;
+  return size;
+}
+
+
+void BufferedPrint::flush() {
+  if (length_) {
+    out_.write(buffer_, length_);
+    length_ = 0;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : Body ////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+Body::Body(Client &client) : client_(client) {
+  reset(0, false);
+}
+
+
+int Body::available() {
+  if (!ready()) {
+    return 0;
+  }
+  int available = client_.available();
+  if (remaining_ >= 0 && available > remaining_) {
+    available = (int) remaining_;
+  }
+  return available;
+}
+
+
+int Body::read() {
+  char c;
+  return (readBytes(&c, 1) == 1) ? (unsigned char) c : -1;
+}
+
+
+int Body::peek() {
+  return ready() ? client_.peek() : -1;
+}
+
+
+size_t Body::readBytes(char *buffer, size_t length) {
+  if (!ready()) {
+    return 0;
+  }
+  if (remaining_ >= 0 && length > (size_t) remaining_) {
+    length = remaining_;
+  }
+  size_t count = client_.readBytes(buffer, length);
+  if (remaining_ >= 0) {
+    remaining_ -= count;
+  } else if (count == 0 && !client_.connected()) {
+    done_ = true;
+  }
+  return count;
+}
+
+
+size_t Body::write(uint8_t c) {
+  return 0;
+}
+
+
+void Body::reset(long length, bool chunked) {
+  remaining_ = chunked ? 0 : length;
+  chunked_ = chunked;
+  first_chunk_ = true;
+  done_ = !chunked && length == 0;
+}
+
+
+bool Body::ready() {
+  // True while there is more body to read; Moves on to the next chunk as needed.
+  if (!done_ && remaining_ == 0 && !(chunked_ && nextChunk())) {
+    done_ = true;
+  }
+  return !done_;
+}
+
+
+bool Body::nextChunk() {
+  char line[20];
+  size_t length = 0;
+  // Each chunk is "<size in hex>\r\n<data>\r\n"; The data of the previous chunk has been read, but not its CRLF.
+  if (!first_chunk_) {
+    char crlf[2];
+    if (client_.readBytes(crlf, 2) != 2) {
+      return false;
+    }
+  }
+  first_chunk_ = false;
+  while (length < sizeof(line) - 1 && client_.readBytes(line + length, 1) == 1 && line[length] != '\n') {
+    ++length;
+  }
+  line[length] = '\0';
+  remaining_ = strtol(line, nullptr, 16);
+  if (remaining_ <= 0) {
+    // Last chunk; Skip any trailers up to the blank line ending the body.
+    while (length > 1) {
+      length = 0;
+      while (client_.readBytes(line, 1) == 1 && line[0] != '\n') {
+        ++length;
+      }
+    }
+    remaining_ = 0;
+    return false;
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : AsyncResponse ///////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+AsyncResponse::AsyncResponse() {
+  reset();
+}
+
+
+AsyncResponse::Status AsyncResponse::status() const {
+  return status_;
+}
+
+
+int AsyncResponse::statusCode() const {
+  return status_code_;
+}
+
+
+void AsyncResponse::reset() {
+  if (parser_) {
+    parser_->reset();
+  }
+  body_.clear();
+  position_ = 0;
+  line_length_ = 0;
+  remaining_ = -1;
+  status_code_ = 0;
+  status_ = RECEIVING;
+  phase_ = STATUS_LINE;
+  chunked_ = false;
+  keep_alive_ = false;
+  received_ = false;
+}
+
+
+void AsyncResponse::setParser(json::JsonPushParser *parser) {
+  parser_ = parser;
+}
+
+
+int AsyncResponse::available() {
+  return (int) (body_.size() - position_);
+}
+
+
+int AsyncResponse::read() {
+  return position_ < body_.size() ? (unsigned char) body_[position_++] : -1;
+}
+
+
+int AsyncResponse::peek() {
+  return position_ < body_.size() ? (unsigned char) body_[position_] : -1;
+}
+
+
+size_t AsyncResponse::readBytes(char *buffer, size_t length) {
+  if (length > body_.size() - position_) {
+    length = body_.size() - position_;
+  }
+  memcpy(buffer, body_.data() + position_, length);
+  position_ += length;
+  return length;
+}
+
+
+size_t AsyncResponse::write(uint8_t c) {
+  return 0;
+}
+
+
+size_t AsyncResponse::feed(const char *data, size_t length) {
+  size_t used = 0;
+  received_ = received_ || length > 0;
+  while (used < length && status_ == RECEIVING) {
+    if (phase_ == BODY || phase_ == CHUNK_DATA) {
+      size_t count = length - used;
+      if (remaining_ >= 0 && count > (size_t) remaining_) {
+        count = remaining_;
+      }
+      if (!append(data + used, count)) {
+        return used;
+      }
+      used += count;
+      if (remaining_ > 0) {
+        remaining_ -= count;
+        if (remaining_ == 0) {
+          if (phase_ == BODY) {
+            status_ = COMPLETE;
+          } else {
+            phase_ = CHUNK_END;
+          }
+        }
+      }
+      continue;
+    }
+    // Everything else is read a line at a time; Overlong lines are truncated.
+    char c = data[used++];
+    if (c != '\n') {
+      if (line_length_ < sizeof(line_) - 1) {
+        line_[line_length_++] = c;
+      }
+      continue;
+    }
+    if (line_length_ && line_[line_length_ - 1] == '\r') {
+      --line_length_;
+    }
+    line_[line_length_] = '\0';
+    line_length_ = 0;
+    endLine();
+  }
+  return used;
+}
+
+
+void AsyncResponse::endLine() {
+  switch (phase_) {
+    case STATUS_LINE: {
+      // "HTTP/1.1 200 OK"
+      const char *code = strchr(line_, ' ');
+      if (strncmp(line_, "HTTP/", 5) != 0 || code == nullptr) {
+        status_ = FAILED;
+        return;
+      }
+      status_code_ = atoi(code + 1);
+      keep_alive_ = strncmp(line_, "HTTP/1.1", 8) == 0;
+      phase_ = HEADER;
+      return;
+    }
+    case HEADER:
+      if (line_[0] == '\0') {
+        if (chunked_) {
+          phase_ = CHUNK_SIZE;
+        } else if (remaining_ == 0) {
+          status_ = COMPLETE;
+        } else {
+          // A body that runs until the connection closes can't be followed by another response.
+          keep_alive_ = keep_alive_ && remaining_ > 0;
+          phase_ = BODY;
+        }
+      } else if (strncasecmp(line_, "Content-Length:", 15) == 0) {
+        remaining_ = atol(line_ + 15);
+        if (parser_ == nullptr) {
+          if (remaining_ > SPHUE_ASYNC_MAX_BODY) {
+            status_ = FAILED;
+            return;
+          }
+          body_.reserve(remaining_);
+        }
+      } else if (strncasecmp(line_, "Transfer-Encoding:", 18) == 0) {
+        chunked_ = strstr(line_ + 18, "chunked") != nullptr;
+      } else if (strncasecmp(line_, "Connection:", 11) == 0 && strstr(line_ + 11, "close") != nullptr) {
+        keep_alive_ = false;
+      }
+      return;
+    case CHUNK_SIZE:
+      remaining_ = strtol(line_, nullptr, 16);
+      phase_ = (remaining_ > 0) ? CHUNK_DATA : TRAILER;
+      return;
+    case CHUNK_END:
+      phase_ = CHUNK_SIZE;
+      return;
+    case TRAILER:
+      if (line_[0] == '\0') {
+        status_ = COMPLETE;
+      }
+      return;
+    default:
+      return;
+  }
+}
+
+
+bool AsyncResponse::append(const char *data, size_t length) {
+  if (parser_) {
+    parser_->feed(data, length);
+    return true;
+  }
+  if (body_.size() + length > SPHUE_ASYNC_MAX_BODY) {
+    status_ = FAILED;
+    return false;
+  }
+  body_.insert(body_.end(), data, data + length);
+  return true;
+}
+
+
+void AsyncResponse::close() {
+  if (status_ == RECEIVING) {
+    status_ = (phase_ == BODY && remaining_ < 0) ? COMPLETE : FAILED;
+  }
+  keep_alive_ = false;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : Connection //////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+Connection::Connection(Client &client, const char *host, uint16_t port)
+    : client_(client), host_(host), port_(port), body_(client) {
+  //
+}
+
+
+Stream &Connection::send(const char *method, const char *path, json::JsonSerializable *body) {
+  // The body is measured first so it can be streamed after a Content-Length header, without being built in memory.
+  size_t length = body ? body->measureJson() : 0;
+  const bool retriable = isRetriable(method);
+  do {
+    if (!begin()) {
+      return body_;
+    }
+    BufferedPrint out(client_);
+    writeHead(out, method, path, body != nullptr, length);
+    if (body) {
+      body->printTo(out);
+    }
+    out.flush();
+  } while (!end(client_.connected()) && dropped_ && reused_ && retriable);
+  return body_;
+}
+
+
+Stream &Connection::send(const char *method, const char *path, const char *body, size_t length) {
+  const bool retriable = isRetriable(method);
+  do {
+    if (!begin()) {
+      return body_;
+    }
+    BufferedPrint out(client_);
+    writeHead(out, method, path, body != nullptr, length);
+    if (body) {
+      out.write((const uint8_t *) body, length);
+    }
+    out.flush();
+  } while (!end(client_.connected()) && dropped_ && reused_ && retriable);
+  return body_;
+}
+
+
+bool Connection::write(const char *method, const char *path, const char *body, size_t length) {
+  if (pending_ == 0 && !begin()) {
+    return false;
+  }
+  BufferedPrint out(client_);
+  writeHead(out, method, path, body != nullptr, length);
+  if (body) {
+    out.write((const uint8_t *) body, length);
+  }
+  out.flush();
+  if (!client_.connected()) {
+    return false;
+  }
+  ++pending_;
+  return true;
+}
+
+
+Stream &Connection::receive() {
+  status_code_ = 0;
+  body_.reset(0, false);
+  if (pending_ == 0) {
+    dropped_ = true;
+    return body_;
+  }
+  --pending_;
+  dropped_ = false;
+  end(true);
+  return body_;
+}
+
+
+AsyncResponse::Status Connection::poll(AsyncResponse &response) {
+  if (pending_ == 0) {
+    response.close();
+  }
+  char buffer[64];
+  bool overrun = false;
+  while (response.status_ == AsyncResponse::RECEIVING) {
+    int available = client_.available();
+    if (available <= 0) {
+      if (!client_.connected()) {
+        response.close();
+      }
+      break;
+    }
+    size_t length = client_.readBytes(buffer, (size_t) available < sizeof(buffer) ? available : sizeof(buffer));
+    // Anything past the end of the response was not asked for.
+    overrun = response.feed(buffer, length) < length;
+  }
+  if (response.status_ == AsyncResponse::RECEIVING) {
+    return response.status_;
+  }
+  status_code_ = response.status_code_;
+  dropped_ = !response.received_;
+  reusable_ = response.status_ == AsyncResponse::COMPLETE && response.keep_alive_ && idle_timeout_ != 0 && !overrun;
+  if (pending_) {
+    --pending_;
+  }
+  finish();
+  return response.status_;
+}
+
+
+bool Connection::isRetriable(const char *method) {
+  // Each POST the bridge receives creates something, so it is never sent twice.
+  return strcmp(method, "POST") != 0;
+}
+
+
+uint8_t Connection::pending() const {
+  return pending_;
+}
+
+
+bool Connection::dropped() const {
+  return dropped_;
+}
+
+
+int Connection::statusCode() const {
+  return status_code_;
+}
+
+
+void Connection::finish() {
+  if (reusable_) {
+    // The next response has to start at its status line.
+    char scratch[32];
+    while (body_.readBytes(scratch, sizeof(scratch)) > 0) {
+      //
+    }
+    reusable_ = !body_.ready() && client_.connected();
+  }
+  if (reusable_) {
+    last_used_ = millis();
+  } else {
+    client_.stop();
+    pending_ = 0;
+  }
+  body_.reset(0, false);
+}
+
+
+void Connection::close() {
+  reusable_ = false;
+  finish();
+}
+
+
+void Connection::setIdleTimeout(unsigned long timeout) {
+  idle_timeout_ = timeout;
+}
+
+
+bool Connection::begin() {
+  status_code_ = 0;
+  body_.reset(0, false);
+  // Leftover input means the bridge sent something unasked, likely a timeout notice before closing.
+  reused_ = reusable_ && millis() - last_used_ < idle_timeout_ && client_.connected() && client_.available() == 0;
+  reusable_ = false;
+  dropped_ = false;
+  if (reused_) {
+    return true;
+  }
+  client_.stop();
+  return client_.connect(host_.c_str(), port_);
+}
+
+
+bool Connection::end(bool sent) {
+  if (!sent) {
+    dropped_ = true;
+  } else if (readHead()) {
+    return true;
+  }
+  body_.reset(0, false);
+  client_.stop();
+  reusable_ = false;
+  pending_ = 0;
+  return false;
+}
+
+
+void Connection::writeHead(Print &out, const char *method, const char *path, bool has_body, size_t length) {
+  out.print(method);
+  out.print(' ');
+  out.print(path);
+  out.print(" HTTP/1.1\r\nHost: ");
+  out.print(host_);
+  if (port_ != 80) {
+    out.print(':');
+    out.print((unsigned int) port_);
+  }
+  out.print("\r\n");
+  // Connections are persistent by default in HTTP/1.1.
+  if (idle_timeout_ == 0) {
+    out.print("Connection: close\r\n");
+  }
+  if (has_body) {
+    out.print("Content-Type: application/json\r\n");
+  }
+  out.print("Content-Length: ");
+  out.print((unsigned long) length);
+  out.print("\r\n\r\n");
+}
+
+
+bool Connection::readHead() {
+  char line[64];
+  // Status line; "HTTP/1.1 200 OK"
+  if (!readLine(line, sizeof(line))) {
+    // Only a connection seen closed with nothing received was dropped; A slow bridge may still act on the request.
+    dropped_ = line[0] == '\0' && !client_.connected();
+    return false;
+  }
+  if (strncmp(line, "HTTP/", 5) != 0) {
+    return false;
+  }
+  const char *code = strchr(line, ' ');
+  if (code == nullptr) {
+    return false;
+  }
+  status_code_ = atoi(code + 1);
+  bool keep_alive = idle_timeout_ != 0 && strncmp(line, "HTTP/1.1", 8) == 0;
+  long length = -1;
+  bool chunked = false;
+  while (readLine(line, sizeof(line))) {
+    if (line[0] == '\0') {
+      body_.reset(length, chunked);
+      // A body that runs until the connection closes can't be followed by another response.
+      reusable_ = keep_alive && (length >= 0 || chunked);
+      return true;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      length = atol(line + 15);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      chunked = strstr(line + 18, "chunked") != nullptr;
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      keep_alive = keep_alive && strstr(line + 11, "close") == nullptr;
+    }
+  }
+  return false;
+}
+
+
+bool Connection::readLine(char *dest, size_t size) {
+  // Reads one header line into `dest` without its line ending; Overlong lines are truncated.
+  size_t length = 0;
+  dest[0] = '\0';
+  char c;
+  while (client_.readBytes(&c, 1) == 1) {
+    if (c == '\n') {
+      if (length && dest[length - 1] == '\r') {
+        --length;
+      }
+      dest[length] = '\0';
+      return true;
+    }
+    if (length < size - 1) {
+      dest[length++] = c;
+    }
+  }
+  return false;
+}
+
+}
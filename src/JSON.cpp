@@ -2,6 +2,7 @@
 #include <algorithm>
 
 #include "JSON.h"
+#include "JsonScan.h"
 
 namespace json {
 
@@ -11,6 +12,263 @@ std::unique_ptr<T> make_unique( Args&& ...args ) {
 }
 
 
+size_t formatIndex(char *dest, unsigned long value) {
+  // Writes `value` in decimal and returns its length.
+  char digits[20];
+  size_t length = 0;
+  do {
+    digits[length++] = '0' + (value % 10);
+    value /= 10;
+  } while (value);
+  for (size_t i = 0; i < length; ++i) {
+    dest[i] = digits[length - 1 - i];
+  }
+  dest[length] = '\0';
+  return length;
+}
+
+
+size_t encodeUtf8(char *dest, unsigned long code) {
+  // Writes `code` as UTF-8 and returns its length.
+  if (code < 0x80) {
+    dest[0] = (char) code;
+    return 1;
+  }
+  if (code < 0x800) {
+    dest[0] = (char) (0xC0 | (code >> 6));
+    dest[1] = (char) (0x80 | (code & 0x3F));
+    return 2;
+  }
+  if (code < 0x10000) {
+    dest[0] = (char) (0xE0 | (code >> 12));
+    dest[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+    dest[2] = (char) (0x80 | (code & 0x3F));
+    return 3;
+  }
+  dest[0] = (char) (0xF0 | (code >> 18));
+  dest[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+  dest[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+  dest[3] = (char) (0x80 | (code & 0x3F));
+  return 4;
+}
+
+
+bool readHex(const char *src, size_t length, unsigned long &dest) {
+  if (length < 4) {
+    return false;
+  }
+  dest = 0;
+  for (int i = 0; i < 4; ++i) {
+    const char c = src[i];
+    if (!isxdigit((unsigned char) c)) {
+      return false;
+    }
+    dest = (dest << 4) | (isdigit((unsigned char) c) ? c - '0' : (tolower((unsigned char) c) - 'a' + 10));
+  }
+  return true;
+}
+
+
+bool unescape(String &dest, size_t start) {
+  // Decodes the escape sequences in `dest` from `start` on, in place. Decoded text is never longer than its escaped
+  // form: \uXXXX is at most three bytes of UTF-8, and a surrogate pair (twelve bytes escaped) is four.
+  char *s = dest.begin();
+  const size_t length = dest.length();
+  size_t out = start;
+  size_t in = start;
+  while (in < length) {
+    char c = s[in++];
+    if (c != '\\') {
+      s[out++] = c;
+      continue;
+    }
+    if (in == length) {
+      return false;
+    }
+    c = s[in++];
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        s[out++] = c;
+        break;
+      case 'b':
+        s[out++] = '\b';
+        break;
+      case 'f':
+        s[out++] = '\f';
+        break;
+      case 'n':
+        s[out++] = '\n';
+        break;
+      case 'r':
+        s[out++] = '\r';
+        break;
+      case 't':
+        s[out++] = '\t';
+        break;
+      case 'u': {
+        unsigned long code;
+        if (!readHex(s + in, length - in, code)) {
+          return false;
+        }
+        in += 4;
+        if (code >= 0xD800 && code <= 0xDBFF) {
+          unsigned long low;
+          if (length - in >= 6 && s[in] == '\\' && s[in + 1] == 'u' && readHex(s + in + 2, 4, low)
+              && low >= 0xDC00 && low <= 0xDFFF) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            in += 6;
+          } else {
+            code = 0xFFFD;
+          }
+        } else if (code >= 0xDC00 && code <= 0xDFFF) {
+          // Unpaired low surrogate.
+          code = 0xFFFD;
+        }
+        out += encodeUtf8(s + out, code);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  dest.remove(out);
+  return true;
+}
+
+
+// Collects printed output in a String.
+class StringPrint : public Print {
+ public:
+  explicit StringPrint(String &dest) : dest_(dest) {
+    //
+  }
+  size_t write(uint8_t c) override {
+    dest_.concat((char) c);
+    return 1;
+  }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    dest_.concat((const char *) buffer, size);
+    return size;
+  }
+ private:
+  String &dest_;
+};
+
+
+size_t measureInteger(long value) {
+  size_t length = (value < 0) ? 2 : 1;
+  unsigned long magnitude = (value < 0) ? -(unsigned long) value : value;
+  while (magnitude >= 10) {
+    magnitude /= 10;
+    ++length;
+  }
+  return length;
+}
+
+
+size_t measureReal(double value, bool single) {
+  char buffer[SPHUE_FORMAT_REAL_SIZE];
+  return formatReal(buffer, value, SPHUE_JSON_REAL_PRECISION, single);
+}
+
+
+size_t printInteger(Print &out, int32_t value) {
+  char buffer[SPHUE_FORMAT_INTEGER_SIZE];
+  return out.write(buffer, formatInteger(buffer, value));
+}
+
+
+size_t printReal(Print &out, double value, bool single) {
+  char buffer[SPHUE_FORMAT_REAL_SIZE];
+  return out.write(buffer, formatReal(buffer, value, SPHUE_JSON_REAL_PRECISION, single));
+}
+
+
+size_t printProgKey(Print &out, const char *key) {
+  // Writes a PROGMEM key, quoted. Keys are plain identifiers and need no escaping.
+  char buffer[32];
+  size_t written = out.write('"');
+  size_t length = 0;
+  char c;
+  while ((c = (char) pgm_read_byte(key++)) != '\0') {
+    buffer[length++] = c;
+    if (length == sizeof(buffer)) {
+      written += out.write((const uint8_t *) buffer, length);
+      length = 0;
+    }
+  }
+  written += out.write((const uint8_t *) buffer, length);
+  written += out.write('"');
+  return written;
+}
+
+
+size_t measureString(const char *value, size_t length) {
+  size_t measured = length + 2;
+  for (const char *p = value, *end = value + length; p < end; ++p) {
+    const unsigned char c = *p;
+    if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t') {
+      measured += 1;
+    } else if (c < 0x20) {
+      measured += 5;
+    }
+  }
+  return measured;
+}
+
+
+size_t printString(Print &out, const char *value, size_t length) {
+  size_t written = out.write('"');
+  const char *run = value;
+  const char *end = value + length;
+  for (const char *p = value; p < end; ++p) {
+    const unsigned char c = *p;
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    // Write the run of plain characters before this one in a single call, then its escape.
+    written += out.write((const uint8_t *) run, p - run);
+    run = p + 1;
+    char escape[7] = {'\\', (char) c, '\0'};
+    switch (c) {
+      case '"':
+      case '\\':
+        break;
+      case '\b':
+        escape[1] = 'b';
+        break;
+      case '\f':
+        escape[1] = 'f';
+        break;
+      case '\n':
+        escape[1] = 'n';
+        break;
+      case '\r':
+        escape[1] = 'r';
+        break;
+      case '\t':
+        escape[1] = 't';
+        break;
+      default: {
+        static const char hex[] = "0123456789abcdef";
+        memcpy(escape + 1, "u00", 3);
+        escape[4] = hex[c >> 4];
+        escape[5] = hex[c & 0x0F];
+        escape[6] = '\0';
+        written += out.write((const uint8_t *) escape, 6);
+        continue;
+      }
+    }
+    written += out.write((const uint8_t *) escape, 2);
+  }
+  written += out.write((const uint8_t *) run, end - run);
+  written += out.write('"');
+  return written;
+}
+
+
 unsigned long strToLong(String &value) {
   bool negative = false;
   int result = 0;
@@ -22,7 +280,7 @@ unsigned long strToLong(String &value) {
   char c;
   for (; i < value.length(); ++i) {
     c = value[i];
-    if (!isdigit(c)) {
+    if (!isdigit((unsigned char) c)) {
       break;
     }
     result = (result * 10) + (c - '0');
@@ -35,15 +293,63 @@ unsigned long strToLong(String &value) {
 // Class : JsonParser //////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-JsonParser::JsonParser(Stream &src) : src_(src) {
+JsonParser::JsonParser(Stream &src, size_t buffer_size)
+    : src_(src), buffer_(new char[buffer_size]), buffer_size_(buffer_size), owns_buffer_(true),
+      pos_(buffer_), end_(buffer_) {
   //
 }
 
 
+JsonParser::JsonParser(Stream &src, char *buffer, size_t buffer_size)
+    : src_(src), buffer_(buffer), buffer_size_(buffer_size), owns_buffer_(false), pos_(buffer_), end_(buffer_) {
+  //
+}
+
+
+JsonParser::~JsonParser() {
+  if (owns_buffer_) {
+    delete[] buffer_;
+  }
+}
+
+
+bool JsonParser::fill() {
+  // Pull whatever the source has ready, up to one block, in a single call. When nothing is ready yet, wait (up to the
+  // stream's timeout) for one byte rather than taking a slow link for the end of input. A wait that comes back empty
+  // is the end of input; Truncated input would otherwise cost a full timeout for every value still being looked for.
+  if (exhausted_) {
+    return false;
+  }
+  yield();
+  int ready = src_.available();
+  size_t count = src_.readBytes(buffer_, (ready > 0) ? std::min((size_t) ready, buffer_size_) : 1);
+  pos_ = buffer_;
+  end_ = buffer_ + count;
+  exhausted_ = (count == 0);
+  return count > 0;
+}
+
+
 bool JsonParser::get(JsonModel &dest) {
   yield();
   if (findObject()) {
-    src_.read();
+    read();
+    const JsonKeyTable *table = dest.keyTable();
+    if (table) {
+      int field;
+      while (findNextKey(*table, field)) {
+        findValue();
+        if (field < 0 || !dest.onField(field, *this)) {
+          skipValue();
+        }
+        yield();
+      }
+      if (findChar('}')) {
+        read();
+        return true;
+      }
+      return false;
+    }
     String key;
     while (findNextKey(key)) {
       if (!findValue()) {
@@ -58,7 +364,7 @@ bool JsonParser::get(JsonModel &dest) {
       yield();
     }
     if (findChar('}')) {
-      src_.read();
+      read();
       return true;
     }
   }
@@ -67,14 +373,12 @@ bool JsonParser::get(JsonModel &dest) {
 
 
 bool JsonParser::findChar(const unsigned char find, const bool skipWhitespace) {
-  unsigned char next;
-  while (src_.available()) {
-    next = src_.peek();
-    if (skipWhitespace && isspace(next)) {
-      // Skipping occurrences of whitespace characters
-      src_.read();
-    } else {
-      return next == find;
+  while (available()) {
+    // Skipping occurrences of whitespace characters
+    const char *p = skipWhitespace ? scan::skipWhitespace(pos_, end_) : pos_;
+    pos_ = p;
+    if (p < end_) {
+      return (unsigned char) *p == find;
     }
   }
   return false;
@@ -82,14 +386,18 @@ bool JsonParser::findChar(const unsigned char find, const bool skipWhitespace) {
 
 
 bool JsonParser::findChar(const unsigned char find, const char skipChar, const bool skipWhitespace) {
-  unsigned char next;
-  while (src_.available()) {
-    next = src_.peek();
-    if (next == skipChar || (skipWhitespace && isspace(next))) {
-      // Skipping occurrences of `skipChar` and whitespace characters
-      src_.read();
-    } else {
-      return next == find;
+  while (available()) {
+    // Skipping occurrences of `skipChar` and whitespace characters
+    const char *p = skipWhitespace ? scan::skipWhitespace(pos_, end_) : pos_;
+    while (p < end_ && *p == skipChar) {
+      ++p;
+      if (skipWhitespace) {
+        p = scan::skipWhitespace(p, end_);
+      }
+    }
+    pos_ = p;
+    if (p < end_) {
+      return (unsigned char) *p == find;
     }
   }
   return false;
@@ -97,14 +405,15 @@ bool JsonParser::findChar(const unsigned char find, const char skipChar, const b
 
 
 bool JsonParser::findChar(const unsigned char find, const char *skipChars, const bool skipWhitespace) {
-  unsigned char next;
-  while (src_.available()) {
-    next = src_.peek();
-    if (strchr(skipChars, next) != nullptr || (skipWhitespace && isspace(next))) {
+  while (available()) {
+    const char *p = pos_;
+    while (p < end_ && (strchr(skipChars, *p) != nullptr || (skipWhitespace && scan::isWhitespace(*p)))) {
       // Skipping occurrences of characters in `skipChars` and whitespace characters
-      src_.read();
-    } else {
-      return next == find;
+      ++p;
+    }
+    pos_ = p;
+    if (p < end_) {
+      return (unsigned char) *p == find;
     }
   }
   return false;
@@ -112,7 +421,7 @@ bool JsonParser::findChar(const unsigned char find, const char *skipChars, const
 
 
 JsonValueType JsonParser::checkValueType() {
-  return checkValueType(src_.peek());
+  return checkValueType(peek());
 }
 
 
@@ -162,14 +471,90 @@ bool JsonParser::findNextKey(String &dest) {
 }
 
 
+inline unsigned char keyCharAt(const JsonKeyTable &table, uint8_t index, size_t offset) {
+  const char *key = (const char *) pgm_read_ptr(&table.keys[index]);
+  return pgm_read_byte(key + offset);
+}
+
+
+bool JsonParser::findNextKey(const JsonKeyTable &table, int &field) {
+  if (!findChar('"', ',')) {
+    return false;
+  }
+  ++pos_;
+  // Candidate keys are the range [first, last) of the sorted table. Every candidate shares the bytes matched so far,
+  // so each new byte narrows the range like a step down a trie.
+  uint8_t first = 0, last = table.size;
+  size_t offset = 0;
+  while (available()) {
+    const char *p = pos_;
+    for (; p < end_; ++p, ++offset) {
+      unsigned char c = *p;
+      if (c == '"') {
+        pos_ = p + 1;
+        field = (first < last && keyCharAt(table, first, offset) == '\0') ? first : -1;
+        return true;
+      }
+      if (c == '\\') {
+        // Escaped characters never appear in table keys.
+        first = last;
+      }
+      while (first < last && keyCharAt(table, first, offset) < c) {
+        ++first;
+      }
+      uint8_t end = first;
+      while (end < last && keyCharAt(table, end, offset) == c) {
+        ++end;
+      }
+      last = end;
+      if (first == last) {
+        // Unknown key; Skip the remainder without looking at the table again.
+        pos_ = p;
+        field = -1;
+        return skipString();
+      }
+    }
+    pos_ = p;
+  }
+  return false;
+}
+
+
+bool JsonParser::skipString() {
+  // Skips to just past the closing quote of a string whose opening quote has already been consumed.
+  bool escaped = false;
+  while (available()) {
+    const char *p = pos_;
+    if (escaped) {
+      ++p;
+      escaped = false;
+    }
+    while ((p = scan::findStringEnd(p, end_)) < end_) {
+      if (*p == '"') {
+        pos_ = p + 1;
+        return true;
+      }
+      // Backslash; The escaped character may be in the next block.
+      if (++p == end_) {
+        escaped = true;
+        break;
+      }
+      ++p;
+    }
+    pos_ = end_;
+  }
+  return false;
+}
+
+
 bool JsonParser::peekMatches(unsigned char c) {
-  return src_.available() && src_.peek() == c;
+  return available() && (unsigned char) *pos_ == c;
 }
 
 
 bool JsonParser::readMatches(unsigned char c) {
-  if (src_.available() && src_.peek() == c) {
-    src_.read();
+  if (available() && (unsigned char) *pos_ == c) {
+    ++pos_;
     return true;
   }
   return false;
@@ -179,81 +564,100 @@ bool JsonParser::readMatches(unsigned char c) {
 bool JsonParser::readMatches(const char *value, bool case_sensitive) {
   unsigned char srcNext, valueNext;
   for (int i = 0; value[i] != '\0'; ++i) {
+    if (!available()) {
+      return false;
+    }
     if (case_sensitive) {
-      srcNext = src_.peek();
+      srcNext = *pos_;
       valueNext = value[i];
     } else {
-      srcNext = tolower(src_.peek());
-      valueNext = tolower(value[i]);
+      srcNext = tolower((unsigned char) *pos_);
+      valueNext = tolower((unsigned char) value[i]);
     }
     if (srcNext != valueNext) {
       // Next characters don't match; error result.
       return false;
     }
-    src_.read();
+    ++pos_;
   }
   return true;
 }
 
 
 bool JsonParser::skipValue() {
-  char skipTo;
-  while (src_.available()) {
-    switch (src_.peek()) {
-      case '{':
-        skipTo = '}';
-        break;
-      case '[':
-        skipTo = ']';
-        break;
-      case ',':
-      case ']':
-      case '}':
-        return true;
-      default:
-        src_.read();
-        continue;
-    }
-    src_.read();
-    if (skipToChar(skipTo, true)) {
-      src_.read();
-    } else {
-      break;
-    }
-  }
-  return false;
+  // Skips the rest of the current value, stopping on the `,`, `]` or `}` that follows it.
+  return skipUntil(",]}", true);
 }
 
 
 bool JsonParser::skipToChar(unsigned char skipTo, bool recursive) {
+  const char stops[] = {(char) skipTo, '\0'};
+  return skipUntil(stops, recursive);
+}
+
+
+bool JsonParser::skipUntil(const char *stops, bool nested) {
+  // Skips forward until one of the structural characters in `stops` is found outside of any string and, when `nested`
+  // is set, outside of any nested object or array. Iterative; Nesting is tracked with a counter instead of the stack.
   yield();
-  unsigned char c;
-  while (src_.available()) {
-    c = src_.peek();
-    if (c == skipTo) {
-      return true;
-    } else if (recursive) {
-      // If c matches a bracket, read from src_ before performing a recursive skip operation.
-      // TODO: Should this logic be broken out to improve readability?
-      if ((c == '{' && (src_.read(), !skipToChar('}', true))) ||
-          (c == '[' && (src_.read(), !skipToChar(']', true)))) {
+  uint16_t depth = 0;
+  bool in_string = false;
+  bool escaped = false;
+  while (available()) {
+    const char *p = pos_;
+    if (escaped) {
+      ++p;
+      escaped = false;
+    }
+    while (p < end_) {
+      if (in_string) {
+        p = scan::findStringEnd(p, end_);
+        if (p == end_) {
+          break;
+        }
+        if (*p == '"') {
+          in_string = false;
+        } else if (++p == end_) {
+          // Backslash; The escaped character is in the next block.
+          escaped = true;
+          break;
+        }
+        ++p;
+        continue;
+      }
+      p = scan::findStructural(p, end_);
+      if (p == end_) {
         break;
       }
+      const char c = *p;
+      if (depth == 0 && strchr(stops, c) != nullptr) {
+        pos_ = p;
+        return true;
+      }
+      if (c == '"') {
+        in_string = true;
+      } else if (nested && (c == '{' || c == '[')) {
+        ++depth;
+      } else if (nested && (c == '}' || c == ']') && depth > 0) {
+        --depth;
+      }
+      ++p;
     }
-    src_.read();
+    pos_ = end_;
   }
   return false;
 }
 
 
 bool JsonParser::findValue() {
-  unsigned char next;
-  while (src_.available()) {
-    next = src_.peek();
-    if (next == ':' || isspace(next)) {
-      // Skipping occurrences of ':' and whitespace characters
-      src_.read();
-    } else {
+  while (available()) {
+    // Skipping occurrences of ':' and whitespace characters
+    const char *p = scan::skipWhitespace(pos_, end_);
+    while (p < end_ && *p == ':') {
+      p = scan::skipWhitespace(p + 1, end_);
+    }
+    pos_ = p;
+    if (p < end_) {
       return true;
     }
   }
@@ -262,8 +666,8 @@ bool JsonParser::findValue() {
 
 
 bool JsonParser::get(bool &dest) {
-  if (src_.available()) {
-    switch (src_.peek()) {
+  if (available()) {
+    switch (*pos_) {
       case 't':
         if (readMatches("true")) {
           dest = true;
@@ -278,190 +682,887 @@ bool JsonParser::get(bool &dest) {
     }
     skipValue();
   }
-  return false;
+  return false;
+}
+
+
+bool JsonParser::getInteger(unsigned long &magnitude, bool &negative) {
+  double real;
+  bool is_real;
+  if (!getNumber(magnitude, negative, real, is_real)) {
+    return false;
+  }
+  if (is_real) {
+    // Truncate toward zero, saturating at the widest integer we can hold.
+    real = std::fabs(real);
+    magnitude = (real >= (double) std::numeric_limits<unsigned long>::max())
+                ? std::numeric_limits<unsigned long>::max() : (unsigned long) real;
+  }
+  return true;
+}
+
+
+bool JsonParser::get(double &dest) {
+  unsigned long magnitude;
+  bool negative, is_real;
+  if (!getNumber(magnitude, negative, dest, is_real)) {
+    return false;
+  }
+  if (!is_real) {
+    dest = (double) magnitude;
+    if (negative) {
+      dest = -dest;
+    }
+  }
+  return true;
+}
+
+
+bool JsonParser::getNumber(unsigned long &magnitude, bool &negative, double &real, bool &is_real) {
+  bool quoted = readMatches('"');
+  negative = readMatches('-');
+  int used, count;
+  if (!getDigits(magnitude, used, count)) {
+    if (quoted) {
+      skipString();
+    } else {
+      skipValue();
+    }
+    return false;
+  }
+  is_real = false;
+  int next = peek();
+  if (used < count || next == '.' || next == 'e' || next == 'E') {
+    // Fall back to floating point for fractions, exponents and whole numbers too long for an unsigned long.
+    is_real = true;
+    real = (double) magnitude;
+    if (used < count) {
+      real *= std::pow(10.0, count - used);
+    }
+    // Precision
+    if (next == '.') {
+      double precision;
+      if (getPrecision(precision)) {
+        real += precision;
+      }
+      next = peek();
+    }
+    // Exponent
+    if (next == 'e' || next == 'E') {
+      int exponent;
+      if (getExponent(exponent)) {
+        real *= std::pow(10.0, exponent);
+      }
+    }
+    if (negative) {
+      real = -real;
+    }
+  }
+  // Finished parsing
+  if (quoted) {
+    skipString();
+  } else {
+    skipValue();
+  }
+  return true;
+}
+
+
+bool JsonParser::getDigits(unsigned long &dest, int &used, int &count) {
+  // Accumulates digits into `dest` until one more would overflow it. `used` counts digits accumulated, `count` counts
+  // all digits read.
+  const unsigned long limit = std::numeric_limits<unsigned long>::max() / 10;
+  dest = 0;
+  used = 0;
+  count = 0;
+  while (available()) {
+    const char *p = pos_;
+    for (; p < end_ && isdigit((unsigned char) *p); ++p) {
+      unsigned char digit = *p - '0';
+      if (used == count &&
+          (dest < limit || (dest == limit && digit <= std::numeric_limits<unsigned long>::max() % 10))) {
+        dest = (dest * 10) + digit;
+        ++used;
+      }
+      ++count;
+    }
+    pos_ = p;
+    if (p < end_) {
+      break;
+    }
+  }
+  return count > 0;
+}
+
+
+bool JsonParser::getExponent(int &dest) {
+  // Skip exponent symbol
+  int next = peek();
+  if (next == 'e' || next == 'E') {
+    read();
+  }
+  // Skip positive sign; It is legal in the exponent and can be ignored.
+  bool negative = readMatches('-');
+  if (!negative) {
+    readMatches('+');
+  }
+  unsigned long value;
+  int used, count;
+  if (getDigits(value, used, count)) {
+    // Anything beyond this is out of range for a double anyway.
+    dest = (value > 999 || used < count) ? 999 : (int) value;
+    if (negative) {
+      dest = -dest;
+    }
+    return true;
+  }
+  return false;
+}
+
+
+bool JsonParser::getPrecision(double &dest) {
+  readMatches('.');
+  unsigned long value;
+  int used, count;
+  if (getDigits(value, used, count)) {
+    dest = (double) value / std::pow(10.0, used);
+    return true;
+  }
+  return false;
+}
+
+
+bool JsonParser::get(String &dest) {
+  if (!available() || *pos_ != '"') {
+    return false;
+  }
+  ++pos_;
+  // Runs of the window are copied raw in one operation; Escapes are decoded in place once the string is complete.
+  const size_t start = dest.length();
+  bool escaped = false;
+  bool has_escapes = false;
+  while (available()) {
+    const char *p = pos_;
+    if (escaped) {
+      ++p;
+      escaped = false;
+    }
+    while ((p = scan::findStringEnd(p, end_)) < end_ && *p == '\\') {
+      has_escapes = true;
+      if (++p == end_) {
+        escaped = true;
+        break;
+      }
+      ++p;
+    }
+    if (p < end_ && !has_escapes && dest.length() == start) {
+      // The whole string is in the window; Size it exactly.
+      dest.reserve(start + (p - pos_));
+    }
+    dest.concat(pos_, p - pos_);
+    if (p < end_) {
+      pos_ = p + 1;
+      return !has_escapes || unescape(dest, start);
+    }
+    pos_ = end_;
+  }
+  return false;
+}
+
+
+bool JsonParser::getAsString(String &dest) {
+  switch (checkValueType()) {
+    case STRING:
+      return get(dest);
+    case NUMBER:
+    case BOOL:
+    case NUL: {
+      unsigned char c;
+      while (available()) {
+        c = *pos_;
+        if (c == ',' || c == '}' || c == ']' || scan::isWhitespace(c)) {
+          // Reached break / end of value. Success on one-or-more characters read into destination String.
+          return dest.length();
+        } else {
+          dest.concat((char) c);
+          ++pos_;
+        }
+      }
+      return false;
+    }
+    case OBJECT:
+    case ARRAY:
+    case INVALID:
+    default:
+      // TODO: Not implemented!
+      return false;
+  }
+}
+
+bool JsonParser::project(const JsonPath &path, const JsonPathCallback &callback) {
+  return project(&path, 1, callback);
+}
+
+
+bool JsonParser::project(const JsonPath *paths, uint8_t count, const JsonPathCallback &callback) {
+  // Path matches are tracked as a bitmask; Up to 16 paths can be projected at once.
+  if (count == 0 || count > 16) {
+    return false;
+  }
+  for (uint8_t i = 0; i < count; ++i) {
+    if (!paths[i]) {
+      return false;
+    }
+  }
+  JsonPathMatch match;
+  return findValue() && projectValue(paths, count, (uint16_t) ((1UL << count) - 1), match, callback);
+}
+
+
+bool JsonParser::projectValue(const JsonPath *paths, uint8_t count, uint16_t active, JsonPathMatch &match,
+                              const JsonPathCallback &callback) {
+  const uint8_t depth = match.depth_;
+  uint16_t deeper = 0;
+  for (uint8_t i = 0; i < count; ++i) {
+    if (!(active & (1U << i))) {
+      continue;
+    }
+    if (paths[i].depth_ > depth) {
+      deeper |= (1U << i);
+    } else if (paths[i].depth_ == depth) {
+      match.path_ = i;
+      if (callback(*this, match)) {
+        return true;
+      }
+    }
+  }
+  if (!deeper) {
+    return skipValue();
+  }
+  char *key = match.keys_[depth];
+  size_t length;
+  switch (checkValueType()) {
+    case OBJECT: {
+      read();
+      while (findChar('"', ',')) {
+        if (!getKey(key, SPHUE_JSON_PATH_KEY_SIZE, length) || !findValue()) {
+          return false;
+        }
+        uint16_t next = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+          if ((deeper & (1U << i)) && paths[i].matches(depth, key, length)) {
+            next |= (1U << i);
+          }
+        }
+        if (next) {
+          match.depth_ = depth + 1;
+          bool success = projectValue(paths, count, next, match, callback);
+          match.depth_ = depth;
+          if (!success) {
+            return false;
+          }
+        } else if (!skipValue()) {
+          return false;
+        }
+      }
+      return readMatches('}');
+    }
+    case ARRAY: {
+      read();
+      for (unsigned long index = 0; findValue() && !peekMatches(']'); ++index) {
+        length = formatIndex(key, index);
+        uint16_t next = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+          if ((deeper & (1U << i)) && paths[i].matches(depth, key, length)) {
+            next |= (1U << i);
+          }
+        }
+        if (next) {
+          match.depth_ = depth + 1;
+          bool success = projectValue(paths, count, next, match, callback);
+          match.depth_ = depth;
+          if (!success) {
+            return false;
+          }
+        } else if (!skipValue()) {
+          return false;
+        }
+        if (!(findChar(',') && readMatches(','))) {
+          break;
+        }
+      }
+      return findChar(']') && readMatches(']');
+    }
+    default:
+      return skipValue();
+  }
+}
+
+
+bool JsonParser::parse(JsonHandler &handler) {
+  String scratch;
+  // One bit per open container; Set for arrays, clear for objects.
+  uint32_t arrays = 0;
+  uint8_t depth = 0;
+  bool value_expected = true;
+  while (true) {
+    if (value_expected) {
+      if (!findValue()) {
+        return false;
+      }
+      switch (checkValueType()) {
+        case OBJECT:
+        case ARRAY: {
+          if (depth == 32) {
+            return false;
+          }
+          bool array = read() == '[';
+          if (!(array ? handler.onStartArray() : handler.onStartObject())) {
+            return false;
+          }
+          arrays = array ? (arrays | (1UL << depth)) : (arrays & ~(1UL << depth));
+          ++depth;
+          value_expected = false;
+          continue;
+        }
+        case STRING:
+          scratch.clear();
+          if (!get(scratch) || !handler.onString(scratch)) {
+            return false;
+          }
+          break;
+        case NUMBER: {
+          unsigned long magnitude;
+          bool negative, is_real;
+          double real;
+          if (!getNumber(magnitude, negative, real, is_real)) {
+            return false;
+          }
+          if (is_real || magnitude > (unsigned long) std::numeric_limits<long>::max()) {
+            if (!is_real) {
+              real = negative ? -(double) magnitude : (double) magnitude;
+            }
+            if (!handler.onNumber(real)) {
+              return false;
+            }
+          } else if (!handler.onInteger(negative ? -(long) magnitude : (long) magnitude)) {
+            return false;
+          }
+          break;
+        }
+        case BOOL: {
+          bool value;
+          if (!get(value) || !handler.onBool(value)) {
+            return false;
+          }
+          break;
+        }
+        case NUL:
+          if (!readMatches("null") || !handler.onNull()) {
+            return false;
+          }
+          break;
+        case INVALID:
+        default:
+          return false;
+      }
+      if (depth == 0) {
+        return true;
+      }
+      value_expected = false;
+    }
+    // Inside a container, after its opening bracket or after a value.
+    if (!findChar(',')) {
+      int next = peek();
+      if (next == '}' || next == ']') {
+        read();
+        if (!((next == ']') ? handler.onEndArray() : handler.onEndObject())) {
+          return false;
+        }
+        if (--depth == 0) {
+          return true;
+        }
+        continue;
+      }
+      if (next < 0) {
+        return false;
+      }
+    } else {
+      read();
+    }
+    if (arrays & (1UL << (depth - 1))) {
+      value_expected = true;
+    } else if (findChar('"')) {
+      scratch.clear();
+      if (!get(scratch) || !handler.onKey(scratch) || !findValue()) {
+        return false;
+      }
+      value_expected = true;
+    } else {
+      return false;
+    }
+  }
+}
+
+
+bool JsonParser::getKey(char *dest, size_t size, size_t &length) {
+  // Copies the raw bytes of the key at the current position into `dest`, truncating to `size` - 1. `length` is set to
+  // the full length of the key.
+  if (!readMatches('"')) {
+    return false;
+  }
+  length = 0;
+  bool escaped = false;
+  while (available()) {
+    const char *p = pos_;
+    if (escaped) {
+      ++p;
+      escaped = false;
+    }
+    while ((p = scan::findStringEnd(p, end_)) < end_ && *p == '\\') {
+      if (++p == end_) {
+        escaped = true;
+        break;
+      }
+      ++p;
+    }
+    size_t run = p - pos_;
+    if (length < size - 1) {
+      memcpy(dest + length, pos_, std::min(run, size - 1 - length));
+    }
+    length += run;
+    if (p < end_) {
+      dest[std::min(length, size - 1)] = '\0';
+      pos_ = p + 1;
+      return true;
+    }
+    pos_ = end_;
+  }
+  return false;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : JsonPath ////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+JsonPath::JsonPath(const char *path) : path_(path), depth_(0), valid_(path != nullptr) {
+  if (!valid_) {
+    return;
+  }
+  const char *p = (*path == '/') ? path + 1 : path;
+  while (*p) {
+    const char *end = strchr(p, '/');
+    if (end == nullptr) {
+      end = p + strlen(p);
+    }
+    if (depth_ == SPHUE_JSON_PATH_MAX_DEPTH || end - path > 255) {
+      valid_ = false;
+      return;
+    }
+    starts_[depth_] = p - path;
+    lengths_[depth_] = end - p;
+    ++depth_;
+    p = (*end) ? end + 1 : end;
+  }
+}
+
+
+uint8_t JsonPath::depth() const {
+  return depth_;
+}
+
+
+JsonPath::operator bool() const {
+  return valid_;
+}
+
+
+bool JsonPath::matches(uint8_t depth, const char *key, size_t length) const {
+  const char *segment = path_ + starts_[depth];
+  if (lengths_[depth] == 1 && segment[0] == '*') {
+    return true;
+  }
+  return length == lengths_[depth] && length < SPHUE_JSON_PATH_KEY_SIZE && strncmp(segment, key, length) == 0;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : JsonPathMatch ///////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+uint8_t JsonPathMatch::path() const {
+  return path_;
+}
+
+
+uint8_t JsonPathMatch::depth() const {
+  return depth_;
+}
+
+
+const char *JsonPathMatch::key(uint8_t depth) const {
+  return (depth < depth_) ? keys_[depth] : "";
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : JsonPushParser //////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+JsonPushParser::JsonPushParser(JsonHandler &handler) : handler_(handler) {
+  reset();
+}
+
+
+JsonPushParser::Status JsonPushParser::feed(const char *data, size_t length) {
+  const char *end = data + length;
+  while (data < end && status_ == NEED_MORE) {
+    data = step(data, end);
+  }
+  return status_;
+}
+
+
+JsonPushParser::Status JsonPushParser::feed(Stream &src, size_t budget) {
+  char chunk[64];
+  while (status_ == NEED_MORE && budget > 0) {
+    int ready = src.available();
+    if (ready <= 0) {
+      break;
+    }
+    size_t count = src.readBytes(chunk, std::min(std::min((size_t) ready, budget), sizeof(chunk)));
+    if (count == 0) {
+      break;
+    }
+    budget -= count;
+    feed(chunk, count);
+  }
+  return status_;
+}
+
+
+JsonPushParser::Status JsonPushParser::finish() {
+  if (status_ == NEED_MORE) {
+    // A number is only known to be complete once something follows it.
+    bool success = state_ == NUMBER_BODY && depth_ == 0 && emitNumber() && endValue();
+    status_ = success ? COMPLETE : FAILED;
+  }
+  return status_;
+}
+
+
+JsonPushParser::Status JsonPushParser::status() const {
+  return status_;
+}
+
+
+void JsonPushParser::reset() {
+  status_ = NEED_MORE;
+  state_ = VALUE;
+  arrays_ = 0;
+  depth_ = 0;
+  token_.clear();
+  is_key_ = false;
+  escaped_ = false;
+  has_escapes_ = false;
+  literal_ = nullptr;
+  matched_ = 0;
+}
+
+
+const char *JsonPushParser::step(const char *p, const char *end) {
+  switch (state_) {
+    case STRING_BODY:
+      return readString(p, end);
+    case NUMBER_BODY:
+      return readNumber(p, end);
+    case LITERAL_BODY:
+      return readLiteral(p, end);
+    default:
+      break;
+  }
+  p = scan::skipWhitespace(p, end);
+  if (p == end) {
+    return end;
+  }
+  const char c = *p++;
+  bool success;
+  switch (state_) {
+    case FIRST_VALUE:
+      if (c == ']') {
+        --depth_;
+        success = handler_.onEndArray() && endValue();
+        break;
+      }
+      success = startValue(c);
+      break;
+    case VALUE:
+      success = startValue(c);
+      break;
+    case FIRST_KEY:
+      if (c == '}') {
+        --depth_;
+        success = handler_.onEndObject() && endValue();
+        break;
+      }
+      // Fall through
+    case KEY:
+      success = c == '"';
+      token_.clear();
+      is_key_ = true;
+      state_ = STRING_BODY;
+      break;
+    case COLON:
+      success = c == ':';
+      state_ = VALUE;
+      break;
+    case NEXT: {
+      const bool array = arrays_ & (1UL << (depth_ - 1));
+      if (c == ',') {
+        success = true;
+        state_ = array ? VALUE : KEY;
+      } else if (c == (array ? ']' : '}')) {
+        --depth_;
+        success = (array ? handler_.onEndArray() : handler_.onEndObject()) && endValue();
+      } else {
+        success = false;
+      }
+      break;
+    }
+    default:
+      success = false;
+      break;
+  }
+  if (!success) {
+    status_ = FAILED;
+    return end;
+  }
+  return p;
+}
+
+
+const char *JsonPushParser::readString(const char *p, const char *end) {
+  const char *q = p;
+  if (escaped_) {
+    ++q;
+    escaped_ = false;
+  }
+  while ((q = scan::findStringEnd(q, end)) < end && *q == '\\') {
+    has_escapes_ = true;
+    if (++q == end) {
+      escaped_ = true;
+      break;
+    }
+    ++q;
+  }
+  token_.concat(p, q - p);
+  if (q == end) {
+    return end;
+  }
+  bool success;
+  if (has_escapes_ && !unescape(token_, 0)) {
+    success = false;
+  } else if (is_key_) {
+    success = handler_.onKey(token_);
+    state_ = COLON;
+  } else {
+    success = handler_.onString(token_) && endValue();
+  }
+  has_escapes_ = false;
+  if (!success) {
+    status_ = FAILED;
+    return end;
+  }
+  return q + 1;
+}
+
+
+const char *JsonPushParser::readNumber(const char *p, const char *end) {
+  const char *q = p;
+  while (q < end && (isdigit((unsigned char) *q) || *q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-')) {
+    ++q;
+  }
+  token_.concat(p, q - p);
+  if (q < end && !(emitNumber() && endValue())) {
+    status_ = FAILED;
+    return end;
+  }
+  return q;
+}
+
+
+const char *JsonPushParser::readLiteral(const char *p, const char *end) {
+  while (p < end && literal_[matched_]) {
+    if (*p++ != literal_[matched_++]) {
+      status_ = FAILED;
+      return end;
+    }
+  }
+  if (!literal_[matched_] && !(emitLiteral() && endValue())) {
+    status_ = FAILED;
+    return end;
+  }
+  return p;
+}
+
+
+bool JsonPushParser::startValue(const char c) {
+  switch (c) {
+    case '{':
+    case '[':
+      if (depth_ == 32) {
+        return false;
+      }
+      if (c == '[') {
+        arrays_ |= (1UL << depth_);
+        state_ = FIRST_VALUE;
+      } else {
+        arrays_ &= ~(1UL << depth_);
+        state_ = FIRST_KEY;
+      }
+      ++depth_;
+      return (c == '[') ? handler_.onStartArray() : handler_.onStartObject();
+    case '"':
+      token_.clear();
+      is_key_ = false;
+      state_ = STRING_BODY;
+      return true;
+    case 't':
+      literal_ = "true";
+      break;
+    case 'f':
+      literal_ = "false";
+      break;
+    case 'n':
+      literal_ = "null";
+      break;
+    default:
+      if (c != '-' && !isdigit((unsigned char) c)) {
+        return false;
+      }
+      token_.clear();
+      token_.concat(c);
+      state_ = NUMBER_BODY;
+      return true;
+  }
+  matched_ = 1;
+  state_ = LITERAL_BODY;
+  return true;
+}
+
+
+bool JsonPushParser::endValue() {
+  state_ = NEXT;
+  if (depth_ == 0) {
+    status_ = COMPLETE;
+  }
+  return true;
+}
+
+
+bool JsonPushParser::emitNumber() {
+  // Same split as JsonParser::parse(); Integers that fit a long go to onInteger(), everything else to onNumber().
+  const char *p = token_.c_str();
+  const bool negative = *p == '-';
+  if (negative) {
+    ++p;
+  }
+  if (!isdigit((unsigned char) *p)) {
+    return false;
+  }
+  unsigned long magnitude = 0;
+  bool is_real = false;
+  for (; *p; ++p) {
+    if (!isdigit((unsigned char) *p)) {
+      is_real = true;
+      break;
+    }
+    const unsigned long digit = *p - '0';
+    if (magnitude > (std::numeric_limits<unsigned long>::max() - digit) / 10) {
+      is_real = true;
+      break;
+    }
+    magnitude = magnitude * 10 + digit;
+  }
+  if (is_real || magnitude > (unsigned long) std::numeric_limits<long>::max()) {
+    char *parsed;
+    double real = strtod(token_.c_str(), &parsed);
+    return *parsed == '\0' && handler_.onNumber(real);
+  }
+  return handler_.onInteger(negative ? -(long) magnitude : (long) magnitude);
+}
+
+
+bool JsonPushParser::emitLiteral() {
+  switch (literal_[0]) {
+    case 't':
+      return handler_.onBool(true);
+    case 'f':
+      return handler_.onBool(false);
+    default:
+      return handler_.onNull();
+  }
 }
 
 
-bool JsonParser::get(unsigned long &dest) {
-  // Parse the number as into a double, cast result to int on success.
-  double value;
-  if (get(value)) {
-    dest = (unsigned long) value;
-    return true;
-  }
-  return false;
+////////////////////////////////////////////////////////////////
+// Class : JsonSerializable ////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+String JsonSerializable::toJson() {
+  String result;
+  result.reserve(measureJson());
+  StringPrint out(result);
+  printTo(out);
+  return result;
 }
 
 
-bool JsonParser::get(double &dest) {
-  unsigned long value;
-  if (getDigits(value, true)) {
-    // Whole number
-    dest = (double) value;
-    unsigned char next = src_.peek();
-    // Precision
-    if (next == '.') {
-      double precision;
-      if (getPrecision(precision)) {
-        dest += precision;
-      }
-      next = src_.peek();
-    }
-    // Exponent
-    if (next == 'e' || next == 'E') {
-      double exponent;
-      if (getExponent(exponent)) {
-        dest = std::pow(dest, exponent);
-      }
-    }
-    // Finished parsing
-    skipValue();
-    return true;
+////////////////////////////////////////////////////////////////
+// Class : JsonCachedSerializable //////////////////////////////
+////////////////////////////////////////////////////////////////
+
+const String &JsonCachedSerializable::serializedBody() {
+  if (dirty_) {
+    prepare();
+    // Assigning keeps the old buffer, so rebuilding a body of similar size doesn't reallocate.
+    body_ = "";
+    body_.reserve(measureValue());
+    StringPrint out(body_);
+    printValue(out);
+    dirty_ = false;
   }
-  skipValue();
-  return false;
+  return body_;
 }
 
 
-bool JsonParser::getDigits(unsigned long &dest, const bool allow_sign) {
-  String value;
-  while (src_.available()) {
-    switch (src_.peek()) {
-      case '-':
-        if (!allow_sign || value.length()) {
-          // Sign not allowed or is not the first character processed. Abort read.
-          goto CHECK_VALUE;
-        }
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-        value.concat((char) src_.read());
-        yield();
-        break;
-      default:
-        goto CHECK_VALUE;
-    }
-  }
-  CHECK_VALUE:
-  if (value.length()) {
-    dest = strToLong(value);
-    return true;
-  }
-  return false;
+bool JsonCachedSerializable::isDirty() const {
+  return dirty_;
 }
 
 
-bool JsonParser::getExponent(double &dest) {
-  if (src_.available()) {
-    // Skip exponent symbol
-    unsigned char next = src_.peek();
-    if (next == 'e' || next == 'E') {
-      src_.read();
-      next = src_.peek();
-    }
-    // Skip positive sign; It is legal in the exponent and can be ignored.
-    if (next == '+') {
-      src_.read();
-    }
-    // Whole number
-    unsigned long value;
-    if (getDigits(value, true)) {
-      dest = (double) value;
-      // Precision
-      if (src_.peek() == '.') {
-        double precision;
-        if (getPrecision(precision)) {
-          dest += precision;
-        }
-      }
-      return true;
-    }
-  }
-  return false;
+String JsonCachedSerializable::toJson() {
+  return serializedBody();
 }
 
 
-bool JsonParser::getPrecision(double &dest) {
-  if (src_.available()) {
-    if (src_.peek() == '.') {
-      src_.read();
-    }
-    unsigned long value;
-    if (getDigits(value, false)) {
-      dest = (double) value;
-      while (dest >= 1.0) {
-        dest /= 10;
-      }
-      return true;
-    }
-  }
-  return false;
+size_t JsonCachedSerializable::printTo(Print &out) {
+  const String &body = serializedBody();
+  return out.write(body.c_str(), body.length());
 }
 
 
-bool JsonParser::get(String &dest) {
-  if (!src_.available() || src_.peek() != '"') {
-    return false;
-  }
-  src_.read();
-  unsigned char c;
-  bool ignoreNext = false;
-  while (src_.available()) {
-    c = src_.read();
-    if (c == '\\' && !ignoreNext) {
-      ignoreNext = true;
-      dest.concat((char) c);
-      yield();
-      continue;
-    }
-    if (c == '"' && !ignoreNext) {
-      return true;
-    } else {
-      dest.concat((char) c);
-      yield();
-      ignoreNext = false;
-    }
-  }
-  return false;
+size_t JsonCachedSerializable::measureJson() {
+  return serializedBody().length();
 }
 
 
-bool JsonParser::getAsString(String &dest) {
-  switch (checkValueType()) {
-    case STRING:
-      return get(dest);
-    case NUMBER:
-    case BOOL:
-    case NUL: {
-      unsigned char c;
-      while (src_.available()) {
-        c = src_.peek();
-        if (c == ',' || c == '}' || c == ']' || isspace(c)) {
-          // Reached break / end of value. Success on one-or-more characters read into destination String.
-          return dest.length();
-        } else {
-          dest.concat((char) src_.read());
-          yield();
-        }
-      }
-      return false;
-    }
-    case OBJECT:
-    case ARRAY:
-    case INVALID:
-    default:
-      // TODO: Not implemented!
-      return false;
-  }
+void JsonCachedSerializable::markDirty() {
+  dirty_ = true;
 }
 
+
 ////////////////////////////////////////////////////////////////
 // Class : JsonString //////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
@@ -481,13 +1582,13 @@ void JsonString::setValue(String &value) {
 }
 
 
-String JsonString::toJson() {
-  String result{};
-  result.reserve(value_.length() + 2);
-  result.concat('\"');
-  result.concat(value_);
-  result.concat('\"');
-  return result;
+size_t JsonString::printTo(Print &out) {
+  return printString(out, value_.c_str(), value_.length());
+}
+
+
+size_t JsonString::measureJson() {
+  return measureString(value_.c_str(), value_.length());
 }
 
 
@@ -520,8 +1621,13 @@ void JsonBool::setValue(bool value) {
 }
 
 
-String JsonBool::toJson() {
-  return value_ ? "true" : "false";
+size_t JsonBool::printTo(Print &out) {
+  return out.print(value_ ? "true" : "false");
+}
+
+
+size_t JsonBool::measureJson() {
+  return value_ ? 4 : 5;
 }
 
 
@@ -656,18 +1762,30 @@ void JsonNumber::setType(JsonNumberType type) {
 }
 
 
-String JsonNumber::toJson() {
+size_t JsonNumber::printTo(Print &out) {
+  switch (type_) {
+    case INT:
+      return printInteger(out, int_value_);
+    case DOUBLE:
+      return printReal(out, double_value_, false);
+    case FLOAT:
+      return printReal(out, float_value_, true);
+    default:
+      return 0;
+  }
+}
+
+
+size_t JsonNumber::measureJson() {
   switch (type_) {
     case INT:
-      return String{int_value_};
+      return measureInteger(int_value_);
     case DOUBLE:
-      // TODO: add formatting rules for precision?
-      return String{double_value_};
+      return measureReal(double_value_, false);
     case FLOAT:
-      // TODO: add formatting rules for precision?
-      return String{float_value_};
+      return measureReal(float_value_, true);
     default:
-      return "";
+      return 0;
   }
 }
 
@@ -693,23 +1811,23 @@ bool JsonNumber::operator!=(const JsonNumber &rhs) const {
 
 
 ////////////////////////////////////////////////////////////////
-// Class : JsonArray ///////////////////////////////////////////
+// Class : JsonIdArray /////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-template<typename SerializableType>
-JsonArray<SerializableType>::JsonArray(int initial_capacity) : values_(initial_capacity) {
-  //
+template<typename Integer>
+JsonIdArray<Integer>::JsonIdArray(int initial_capacity) {
+  values_.reserve(initial_capacity);
 }
 
 
-template<typename SerializableType>
-void JsonArray<SerializableType>::add(SerializableType &value) {
+template<typename Integer>
+void JsonIdArray<Integer>::add(Integer value) {
   values_.push_back(value);
 }
 
 
-template<typename SerializableType>
-bool JsonArray<SerializableType>::remove(SerializableType &value) {
+template<typename Integer>
+bool JsonIdArray<Integer>::remove(Integer value) {
   auto entry = std::find(values_.begin(), values_.end(), value);
   if (entry == values_.end()) {
     return false;
@@ -719,75 +1837,385 @@ bool JsonArray<SerializableType>::remove(SerializableType &value) {
 }
 
 
-template<typename SerializableType>
-String JsonArray<SerializableType>::toJson() {
-  String result = "[";
-  for (auto it = values_.begin(); it != values_.end(); ++it) {
-    String value = (*it)->toJson();
-    // Reserve additional space on result string; Prevent extra reserve operations from happening on each concatenation.
-    unsigned int concat_len = (*it).first.length() + value.length() + 1;
-    if (it != values_.begin()) {
-      result.reserve(result.length() + concat_len + 1);
-      result += ',';
-    } else {
-      result.reserve(result.length() + concat_len);
+template<typename Integer>
+bool JsonIdArray<Integer>::contains(Integer value) const {
+  return std::find(values_.begin(), values_.end(), value) != values_.end();
+}
+
+
+template<typename Integer>
+size_t JsonIdArray<Integer>::size() const {
+  return values_.size();
+}
+
+
+template<typename Integer>
+void JsonIdArray<Integer>::clear() {
+  values_.clear();
+}
+
+
+template<typename Integer>
+size_t JsonIdArray<Integer>::printTo(Print &out) {
+  // IDs are formatted into a block on the stack, which is written out whenever the next ID might not fit.
+  char buffer[64];
+  size_t used = 0;
+  size_t written = 0;
+  buffer[used++] = '[';
+  for (size_t i = 0; i < values_.size(); ++i) {
+    if (used + SPHUE_FORMAT_INTEGER_SIZE + 4 > sizeof(buffer)) {
+      written += out.write(buffer, used);
+      used = 0;
+    }
+    if (i) {
+      buffer[used++] = ',';
     }
-    result += value;
+    buffer[used++] = '"';
+    used += formatInteger(buffer + used, values_[i]);
+    buffer[used++] = '"';
   }
-  result += ']';
-  return result;
+  buffer[used++] = ']';
+  return written + out.write(buffer, used);
+}
+
+
+template<typename Integer>
+size_t JsonIdArray<Integer>::measureJson() {
+  // Brackets, plus a comma between values and quotes around each.
+  size_t length = values_.empty() ? 2 : 1 + 3 * values_.size();
+  for (auto it = values_.begin(); it != values_.end(); ++it) {
+    length += measureInteger(*it);
+  }
+  return length;
 }
 
 
-template<typename SerializableType>
-bool JsonArray<SerializableType>::operator==(const JsonArray &rhs) const {
+template<typename Integer>
+bool JsonIdArray<Integer>::operator==(const JsonIdArray &rhs) const {
   return values_ == rhs.values_;
 }
 
 
-template<typename SerializableType>
-bool JsonArray<SerializableType>::operator!=(const JsonArray &rhs) const {
+template<typename Integer>
+bool JsonIdArray<Integer>::operator!=(const JsonIdArray &rhs) const {
   return !(rhs == *this);
 }
 
 
+template class JsonIdArray<int>;
+template class JsonIdArray<uint8_t>;
+
+
 ////////////////////////////////////////////////////////////////
-// Class : JsonObject //////////////////////////////////////////
+// Class : JsonCompactObject ///////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-template<typename T>
-void JsonObject::add(String &key, T &value) {
-  values_[key] = make_unique<T>(value);
+bool JsonCompactObject::set(const char *key, bool value) {
+  Member *member = findOrAdd(key);
+  if (member == nullptr) {
+    return false;
+  }
+  if (member->tag != BOOL_VALUE || member->bool_value != value) {
+    retag(*member, BOOL_VALUE);
+    member->bool_value = value;
+    markDirty();
+  }
+  return true;
+}
+
+
+bool JsonCompactObject::set(const char *key, int value) {
+  Member *member = findOrAdd(key);
+  if (member == nullptr) {
+    return false;
+  }
+  if (member->tag != INT_VALUE || member->int_value != value) {
+    retag(*member, INT_VALUE);
+    member->int_value = value;
+    markDirty();
+  }
+  return true;
+}
+
+
+bool JsonCompactObject::set(const char *key, double value) {
+  Member *member = findOrAdd(key);
+  if (member == nullptr) {
+    return false;
+  }
+  if (member->tag != REAL_VALUE || member->real_value != value) {
+    retag(*member, REAL_VALUE);
+    member->real_value = value;
+    markDirty();
+  }
+  return true;
+}
+
+
+bool JsonCompactObject::set(const char *key, float value) {
+  Member *member = findOrAdd(key);
+  if (member == nullptr) {
+    return false;
+  }
+  if (member->tag != FLOAT_VALUE || member->float_value != value) {
+    retag(*member, FLOAT_VALUE);
+    member->float_value = value;
+    markDirty();
+  }
+  return true;
+}
+
+
+bool JsonCompactObject::set(const char *key, const String &value) {
+  Member *member = findOrAdd(key);
+  if (member == nullptr) {
+    return false;
+  }
+  if (member->tag != STRING_VALUE) {
+    strings_.push_back(value);
+    member->tag = STRING_VALUE;
+    member->string_index = strings_.size() - 1;
+    markDirty();
+  } else if (strings_[member->string_index] != value) {
+    strings_[member->string_index] = value;
+    markDirty();
+  }
+  return true;
+}
+
+
+bool JsonCompactObject::get(const char *key, bool &value) const {
+  for (uint8_t i = 0; i < size_; ++i) {
+    if (members_[i].key == key) {
+      if (members_[i].tag != BOOL_VALUE) {
+        return false;
+      }
+      value = members_[i].bool_value;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool JsonCompactObject::get(const char *key, int &value) const {
+  for (uint8_t i = 0; i < size_; ++i) {
+    if (members_[i].key == key) {
+      if (members_[i].tag != INT_VALUE) {
+        return false;
+      }
+      value = members_[i].int_value;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool JsonCompactObject::remove(const char *key) {
+  Member *member = find(key);
+  if (member == nullptr) {
+    return false;
+  }
+  retag(*member, INT_VALUE);
+  // Shift the later members down to keep insertion order.
+  for (Member *end = members_ + size_ - 1; member < end; ++member) {
+    *member = *(member + 1);
+  }
+  --size_;
+  markDirty();
+  return true;
+}
+
+
+bool JsonCompactObject::has(const char *key) const {
+  for (uint8_t i = 0; i < size_; ++i) {
+    if (members_[i].key == key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+uint8_t JsonCompactObject::size() const {
+  return size_;
 }
 
 
+void JsonCompactObject::clear() {
+  strings_.clear();
+  if (size_) {
+    size_ = 0;
+    markDirty();
+  }
+}
+
+
+bool JsonCompactObject::merge(const JsonCompactObject &other) {
+  bool merged = true;
+  for (uint8_t i = 0; i < other.size_; ++i) {
+    const Member &member = other.members_[i];
+    switch (member.tag) {
+      case BOOL_VALUE:
+        merged = set(member.key, member.bool_value) && merged;
+        break;
+      case INT_VALUE:
+        merged = set(member.key, member.int_value) && merged;
+        break;
+      case REAL_VALUE:
+        merged = set(member.key, member.real_value) && merged;
+        break;
+      case FLOAT_VALUE:
+        merged = set(member.key, member.float_value) && merged;
+        break;
+      case STRING_VALUE:
+        merged = set(member.key, other.strings_[member.string_index]) && merged;
+        break;
+    }
+  }
+  return merged;
+}
+
+
+size_t JsonCompactObject::printValue(Print &out) {
+  size_t written = out.write('{');
+  for (uint8_t i = 0; i < size_; ++i) {
+    const Member &member = members_[i];
+    if (i) {
+      written += out.write(',');
+    }
+    written += printProgKey(out, member.key);
+    written += out.write(':');
+    switch (member.tag) {
+      case BOOL_VALUE:
+        written += out.print(member.bool_value ? "true" : "false");
+        break;
+      case INT_VALUE:
+        written += printInteger(out, member.int_value);
+        break;
+      case REAL_VALUE:
+        written += printReal(out, member.real_value, false);
+        break;
+      case FLOAT_VALUE:
+        written += printReal(out, member.float_value, true);
+        break;
+      case STRING_VALUE:
+        written += printString(out, strings_[member.string_index].c_str(), strings_[member.string_index].length());
+        break;
+    }
+  }
+  written += out.write('}');
+  return written;
+}
+
+
+size_t JsonCompactObject::measureValue() {
+  size_t length = size_ ? 2 * size_ + 1 : 2;
+  for (uint8_t i = 0; i < size_; ++i) {
+    const Member &member = members_[i];
+    length += strlen_P(member.key) + 2;
+    switch (member.tag) {
+      case BOOL_VALUE:
+        length += member.bool_value ? 4 : 5;
+        break;
+      case INT_VALUE:
+        length += measureInteger(member.int_value);
+        break;
+      case REAL_VALUE:
+        length += measureReal(member.real_value, false);
+        break;
+      case FLOAT_VALUE:
+        length += measureReal(member.float_value, true);
+        break;
+      case STRING_VALUE:
+        length += measureString(strings_[member.string_index].c_str(), strings_[member.string_index].length());
+        break;
+    }
+  }
+  return length;
+}
+
+
+JsonCompactObject::Member *JsonCompactObject::find(const char *key) {
+  for (uint8_t i = 0; i < size_; ++i) {
+    if (members_[i].key == key) {
+      return &members_[i];
+    }
+  }
+  return nullptr;
+}
+
+
+JsonCompactObject::Member *JsonCompactObject::findOrAdd(const char *key) {
+  Member *member = find(key);
+  if (member == nullptr && size_ < SPHUE_JSON_COMPACT_SIZE) {
+    // The caller sets the value right away.
+    member = &members_[size_++];
+    member->key = key;
+    member->tag = INT_VALUE;
+    member->int_value = 0;
+    markDirty();
+  }
+  return member;
+}
+
+
+void JsonCompactObject::retag(Member &member, Tag tag) {
+  if (member.tag == STRING_VALUE && tag != STRING_VALUE) {
+    // Strings after the released one move down a place.
+    const uint8_t index = member.string_index;
+    strings_.erase(strings_.begin() + index);
+    for (uint8_t i = 0; i < size_; ++i) {
+      if (members_[i].tag == STRING_VALUE && members_[i].string_index > index) {
+        --members_[i].string_index;
+      }
+    }
+  }
+  member.tag = tag;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : JsonObject //////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
 void JsonObject::add(String &key, String &value) {
   values_[key] = make_unique<JsonString>(value);
+  markDirty();
 }
 
 
 void JsonObject::add(String &key, bool value) {
   values_[key] = make_unique<JsonBool>(value);
+  markDirty();
 }
 
 
 void JsonObject::add(String &key, int value) {
   values_[key] = make_unique<JsonNumber>(value);
+  markDirty();
 }
 
 
 void JsonObject::add(String &key, double value) {
   values_[key] = make_unique<JsonNumber>(value);
+  markDirty();
 }
 
 
 void JsonObject::add(String &key, float value) {
   values_[key] = make_unique<JsonNumber>(value);
+  markDirty();
 }
 
 
 bool JsonObject::remove(String &key) {
-  return values_.erase(key);
+  if (values_.erase(key)) {
+    markDirty();
+    return true;
+  }
+  return false;
 }
 
 
@@ -801,25 +2229,28 @@ int JsonObject::size() {
 }
 
 
-String JsonObject::toJson() {
-  String result = "{";
+size_t JsonObject::printValue(Print &out) {
+  size_t written = out.write('{');
   for (auto it = values_.begin(); it != values_.end(); ++it) {
-    String value = (*it).second->toJson();
-    // Reserve additional space on result string; Prevent extra reserve operations from happening on each concatenation.
-    unsigned int concat_len = (*it).first.length() + value.length() + 4;
     if (it != values_.begin()) {
-      result.reserve(result.length() + concat_len + 1);
-      result += ',';
-    } else {
-      result.reserve(result.length() + concat_len);
+      written += out.write(',');
     }
-    result += '\"';
-    result += (*it).first;
-    result += "\":";
-    result += value;
+    written += printString(out, (*it).first.c_str(), (*it).first.length());
+    written += out.write(':');
+    written += (*it).second->printTo(out);
   }
-  result += '}';
-  return result;
+  written += out.write('}');
+  return written;
+}
+
+
+size_t JsonObject::measureValue() {
+  // Braces, plus a colon per member and a comma between members.
+  size_t length = values_.empty() ? 2 : 2 * values_.size() + 1;
+  for (auto it = values_.begin(); it != values_.end(); ++it) {
+    length += measureString((*it).first.c_str(), (*it).first.length()) + (*it).second->measureJson();
+  }
+  return length;
 }
 
 
@@ -99,6 +99,32 @@ const char light_scene[] PROGMEM = "LightScene";
 const char group_scene[] PROGMEM = "GroupScene";
 }
 
+// Key tables; Field IDs are indexes into their table, so both must be kept in ascending key order.
+MAKE_KEY_TABLE(discovery_response_keys, strings::key_id, strings::key_internalipaddress)
+enum DiscoveryResponseField : uint8_t { DISCOVERY_ID, DISCOVERY_INTERNALIPADDRESS };
+
+MAKE_KEY_TABLE(register_response_keys, strings::key_username)
+enum RegisterResponseField : uint8_t { REGISTER_USERNAME };
+
+MAKE_KEY_TABLE(state_keys, strings::key_bri, strings::key_ct, strings::key_hue, strings::key_on,
+               strings::key_reachable, strings::key_sat)
+enum StateField : uint8_t { STATE_BRI, STATE_CT, STATE_HUE, STATE_ON, STATE_REACHABLE, STATE_SAT };
+
+MAKE_KEY_TABLE(light_keys, strings::key_name, strings::key_state, strings::key_uniqueid)
+enum LightField : uint8_t { LIGHT_NAME, LIGHT_STATE, LIGHT_UNIQUEID };
+
+MAKE_KEY_TABLE(group_keys, strings::key_action, strings::key_all_on, strings::key_any_on, strings::key_class,
+               strings::key_lights, strings::key_name, strings::key_recycle, strings::key_sensors,
+               strings::key_state, strings::key_type)
+enum GroupField : uint8_t {
+  GROUP_ACTION, GROUP_ALL_ON, GROUP_ANY_ON, GROUP_CLASS, GROUP_LIGHTS, GROUP_NAME, GROUP_RECYCLE, GROUP_SENSORS,
+  GROUP_STATE, GROUP_TYPE
+};
+
+MAKE_KEY_TABLE(scene_keys, strings::key_group, strings::key_lights, strings::key_locked, strings::key_name,
+               strings::key_recycle, strings::key_type)
+enum SceneField : uint8_t { SCENE_GROUP, SCENE_LIGHTS, SCENE_LOCKED, SCENE_NAME, SCENE_RECYCLE, SCENE_TYPE };
+
 bool stringHasChar(String &string, char find) {
   for (char c : string) {
     if (c == find) {
@@ -126,22 +152,27 @@ bool timestampFromString(String &time, long &dest) {
   return true;
 }
 
-bool parseArrayOfIntStrings(json::JsonParser &parser, std::vector<uint8_t> &dest) {
+bool parseArrayOfIntStrings(json::JsonParser &parser, IdList &dest) {
   if (parser.checkValueType() != json::ARRAY) {
     parser.skipValue();
     return false;
   }
-  String value;
-  json::JsonArrayIterator<String> array = parser.iterateArray<String>();
+  uint8_t value;
+  json::JsonArrayIterator<uint8_t> array = parser.iterateArray<uint8_t>();
   while (array.hasNext()) {
     if (array.getNext(value)) {
-      dest.push_back(value.toInt());
+      dest.push_back(value);
     }
   }
   array.finish();
   return true;
 }
 
+// Whether `id` fits the uint8_t an IdList holds; Anything wider would be truncated to another light's ID.
+bool isLightId(int id) {
+  return id >= 0 && id <= UINT8_MAX;
+}
+
 ////////////////////////////////////////////////////////////////
 // Class : NamedValue //////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
@@ -238,11 +269,20 @@ bool NamedValue::getBool() const {
 // Class : DiscoveryResponse ///////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-bool DiscoveryResponse::onKey(String &key, json::JsonParser &parser) {
-  STR_EQ_INIT(key.c_str())
-  STR_EQ_RET(strings::key_id, parser.get(id_))
-  STR_EQ_RET(strings::key_internalipaddress, parser.get(ip_))
-  return false;
+const json::JsonKeyTable *DiscoveryResponse::keyTable() const {
+  return &discovery_response_keys;
+}
+
+
+bool DiscoveryResponse::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case DISCOVERY_ID:
+      return parser.get(id_);
+    case DISCOVERY_INTERNALIPADDRESS:
+      return parser.get(ip_);
+    default:
+      return false;
+  }
 }
 
 
@@ -265,8 +305,13 @@ const String &RegisterResponse::username() const {
 }
 
 
-bool RegisterResponse::onKey(String &key, json::JsonParser &parser) {
-  return (key == read_prog_str(strings::key_username)) ? parser.get(username_) : false;
+const json::JsonKeyTable *RegisterResponse::keyTable() const {
+  return &register_response_keys;
+}
+
+
+bool RegisterResponse::onField(uint8_t field, json::JsonParser &parser) {
+  return (field == REGISTER_USERNAME) ? parser.get(username_) : false;
 }
 
 
@@ -289,15 +334,28 @@ const String &Light::uniqueid() const {
 }
 
 
-bool State::onKey(String &key, json::JsonParser &parser) {
-  STR_EQ_INIT(key.c_str())
-  STR_EQ_RET(strings::key_on, parser.get(on_))
-  STR_EQ_RET(strings::key_bri, parser.get(bri_))
-  STR_EQ_RET(strings::key_hue, parser.get(hue_))
-  STR_EQ_RET(strings::key_sat, parser.get(sat_))
-  STR_EQ_RET(strings::key_ct, parser.get(ct_))
-  STR_EQ_RET(strings::key_reachable, parser.get(reachable_))
-  return false;
+const json::JsonKeyTable *State::keyTable() const {
+  return &state_keys;
+}
+
+
+bool State::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case STATE_ON:
+      return parser.get(on_);
+    case STATE_BRI:
+      return parser.get(bri_);
+    case STATE_HUE:
+      return parser.get(hue_);
+    case STATE_SAT:
+      return parser.get(sat_);
+    case STATE_CT:
+      return parser.get(ct_);
+    case STATE_REACHABLE:
+      return parser.get(reachable_);
+    default:
+      return false;
+  }
 }
 
 
@@ -335,12 +393,22 @@ bool State::reachable() const {
 // Class : Light ///////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-bool Light::onKey(String &key, json::JsonParser &parser) {
-  STR_EQ_INIT(key.c_str())
-  STR_EQ_RET(strings::key_state, parser.get(state_))
-  STR_EQ_RET(strings::key_name, parser.get(name_))
-  STR_EQ_RET(strings::key_uniqueid, parser.get(uniqueid_))
-  return false;
+const json::JsonKeyTable *Light::keyTable() const {
+  return &light_keys;
+}
+
+
+bool Light::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case LIGHT_STATE:
+      return parser.get(state_);
+    case LIGHT_NAME:
+      return parser.get(name_);
+    case LIGHT_UNIQUEID:
+      return parser.get(uniqueid_);
+    default:
+      return false;
+  }
 }
 
 
@@ -387,91 +455,395 @@ bool NewLights::onKey(String &key, json::JsonParser &parser) {
 }
 
 
+// LightStateChange keeps decrements under keys of their own, which the bridge doesn't know; Sums both into `delta`
+// and returns how many of the two were set.
+inline uint8_t getDelta(const LightStateChange &change, const char *increment_key, const char *decrement_key,
+                        int32_t &delta) {
+  int increment = 0;
+  int decrement = 0;
+  uint8_t found = change.get(increment_key, increment) + change.get(decrement_key, decrement);
+  delta = increment + decrement;
+  return found;
+}
+
+
 ////////////////////////////////////////////////////////////////
 // Class : LightStateChange ////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
+constexpr uint8_t LightStateChange::kMaxFields;
+
+
 void LightStateChange::setOn(bool turned_on) {
-  String key = read_prog_str(strings::key_on);
-  add(key, turned_on);
+  set(strings::key_on, turned_on);
 }
 
 
 void LightStateChange::setBrightness(uint8_t brightness) {
-  String key = read_prog_str(strings::key_bri);
-  add(key, (int) brightness);
+  set(strings::key_bri, (int) brightness);
 }
 
 
 void LightStateChange::setHue(uint16_t hue) {
-  String key = read_prog_str(strings::key_hue);
-  add(key, (int) hue);
+  set(strings::key_hue, (int) hue);
 }
 
 
 void LightStateChange::setSaturation(uint8_t saturation) {
-  String key = read_prog_str(strings::key_sat);
-  add(key, (int) saturation);
+  set(strings::key_sat, (int) saturation);
 }
 
 
 void LightStateChange::setColorTemp(uint16_t color_temp) {
-  String key = read_prog_str(strings::key_ct);
-  add(key, (int) color_temp);
+  set(strings::key_ct, (int) color_temp);
 }
 
 
 void LightStateChange::setTransitionTime(uint16_t time_in_tenths_of_seconds) {
-  String key = read_prog_str(strings::key_transitiontime);
-  add(key, (int) time_in_tenths_of_seconds);
+  set(strings::key_transitiontime, (int) time_in_tenths_of_seconds);
 }
 
 
 void LightStateChange::incrementBrightness(uint8_t brightness_increment) {
-  String key = read_prog_str(strings::key_bri_inc);
-  add(key, (int) brightness_increment);
+  set(strings::key_bri_inc, (int) brightness_increment);
 }
 
 
 void LightStateChange::decrementBrightness(uint8_t brightness_decrement) {
-  String key = read_prog_str(strings::key_bri_dec);
-  add(key, (int) -brightness_decrement);
+  set(strings::key_bri_dec, (int) -brightness_decrement);
 }
 
 
 void LightStateChange::incrementSaturation(uint8_t saturation_increment) {
-  String key = read_prog_str(strings::key_sat_inc);
-  add(key, (int) saturation_increment);
+  set(strings::key_sat_inc, (int) saturation_increment);
 }
 
 
 void LightStateChange::decrementSaturation(uint8_t saturation_decrement) {
-  String key = read_prog_str(strings::key_sat_dec);
-  add(key, (int) -saturation_decrement);
+  set(strings::key_sat_dec, (int) -saturation_decrement);
 }
 
 
 void LightStateChange::incrementHue(uint16_t hue_increment) {
-  String key = read_prog_str(strings::key_hue_inc);
-  add(key, (int) hue_increment);
+  set(strings::key_hue_inc, (int) hue_increment);
 }
 
 
 void LightStateChange::decrementHue(uint16_t hue_decrement) {
-  String key = read_prog_str(strings::key_hue_dec);
-  add(key, (int) -hue_decrement);
+  set(strings::key_hue_dec, (int) -hue_decrement);
 }
 
 
 void LightStateChange::incrementColorTemp(uint16_t color_temp_increment) {
-  String key = read_prog_str(strings::key_ct_inc);
-  add(key, (int) color_temp_increment);
+  set(strings::key_ct_inc, (int) color_temp_increment);
 }
 
 
 void LightStateChange::decrementColorTemp(uint16_t color_temp_decrement) {
-  String key = read_prog_str(strings::key_ct_dec);
-  add(key, (int) -color_temp_decrement);
+  set(strings::key_ct_dec, (int) -color_temp_decrement);
+}
+
+
+// The fields a change can move by a delta, with the range of the value and of its delta.
+struct DeltaField {
+  const char *value_key;
+  const char *increment_key;
+  const char *decrement_key;
+  int32_t min;
+  int32_t max;
+  int32_t max_delta;
+  bool wraps;
+};
+
+const DeltaField delta_fields[] = {
+    {strings::key_bri, strings::key_bri_inc, strings::key_bri_dec, 1, 254, 254, false},
+    {strings::key_sat, strings::key_sat_inc, strings::key_sat_dec, 0, 254, 254, false},
+    {strings::key_hue, strings::key_hue_inc, strings::key_hue_dec, 0, 65535, 65534, true},
+    {strings::key_ct, strings::key_ct_inc, strings::key_ct_dec, 153, 500, 65534, false},
+};
+
+
+bool LightStateChange::merge(const LightStateChange &newer) {
+  const uint8_t count = sizeof(delta_fields) / sizeof(delta_fields[0]);
+  int32_t pending[count];
+  uint8_t pending_found[count];
+  for (uint8_t i = 0; i < count; ++i) {
+    pending_found[i] = getDelta(*this, delta_fields[i].increment_key, delta_fields[i].decrement_key, pending[i]);
+  }
+  bool merged = JsonCompactObject::merge(newer);
+  // Deltas add up rather than overwrite; Added to a value set earlier, they are folded into it. A value set by `newer`
+  // supersedes earlier deltas.
+  for (uint8_t i = 0; i < count; ++i) {
+    const DeltaField &field = delta_fields[i];
+    int32_t delta;
+    uint8_t found = getDelta(newer, field.increment_key, field.decrement_key, delta);
+    const bool sets_value = newer.has(field.value_key);
+    if (!sets_value) {
+      delta += pending[i];
+      found += pending_found[i];
+    }
+    remove(field.increment_key);
+    remove(field.decrement_key);
+    if (!found) {
+      continue;
+    }
+    int value;
+    if (!sets_value && get(field.value_key, value)) {
+      value += delta;
+      if (field.wraps) {
+        value = ((value % (field.max + 1)) + field.max + 1) % (field.max + 1);
+      } else {
+        value = (value < field.min) ? field.min : ((value > field.max) ? field.max : value);
+      }
+      merged = set(field.value_key, value) && merged;
+    } else {
+      delta = (delta < -field.max_delta) ? -field.max_delta : ((delta > field.max_delta) ? field.max_delta : delta);
+      merged = set(field.increment_key, (int) delta) && merged;
+    }
+  }
+  return merged;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : StateChangeBuilder //////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+static_assert(sizeof(state_fields::table) / sizeof(state_fields::table[0]) == StateChangeBuilder::FIELD_COUNT,
+              "state_fields::table must have an entry per StateChangeBuilder::Field");
+
+constexpr size_t StateChangeBuilder::kMaxJsonSize;
+constexpr uint8_t StateChangeBuilder::kNoSlot;
+
+
+template<typename T>
+inline T clamp(T value, T limit) {
+  return (value > limit) ? limit : ((value < -limit) ? -limit : value);
+}
+
+
+void StateChangeBuilder::setOn(bool turned_on) {
+  on_ = turned_on;
+  mark(ON);
+}
+
+
+void StateChangeBuilder::setBrightness(uint8_t brightness) {
+  bri_ = brightness;
+  mark(BRI);
+}
+
+
+void StateChangeBuilder::setHue(uint16_t hue) {
+  hue_ = hue;
+  mark(HUE);
+}
+
+
+void StateChangeBuilder::setSaturation(uint8_t saturation) {
+  sat_ = saturation;
+  mark(SAT);
+}
+
+
+void StateChangeBuilder::setColorTemp(uint16_t color_temp) {
+  ct_ = color_temp;
+  mark(CT);
+}
+
+
+void StateChangeBuilder::setTransitionTime(uint16_t time_in_tenths_of_seconds) {
+  transitiontime_ = time_in_tenths_of_seconds;
+  mark(TRANSITIONTIME);
+}
+
+
+void StateChangeBuilder::incrementBrightness(int16_t brightness_increment) {
+  bri_inc_ = clamp<int16_t>(brightness_increment, 254);
+  mark(BRI_INC);
+}
+
+
+void StateChangeBuilder::incrementSaturation(int16_t saturation_increment) {
+  sat_inc_ = clamp<int16_t>(saturation_increment, 254);
+  mark(SAT_INC);
+}
+
+
+void StateChangeBuilder::incrementHue(int32_t hue_increment) {
+  hue_inc_ = clamp<int32_t>(hue_increment, 65534);
+  mark(HUE_INC);
+}
+
+
+void StateChangeBuilder::incrementColorTemp(int32_t color_temp_increment) {
+  ct_inc_ = clamp<int32_t>(color_temp_increment, 65534);
+  mark(CT_INC);
+}
+
+
+bool StateChangeBuilder::assign(const LightStateChange &change) {
+  clear();
+  uint8_t copied = 0;
+  bool turned_on;
+  if (change.get(strings::key_on, turned_on)) {
+    setOn(turned_on);
+    ++copied;
+  }
+  int value;
+  if (change.get(strings::key_bri, value)) {
+    setBrightness(value);
+    ++copied;
+  }
+  if (change.get(strings::key_hue, value)) {
+    setHue(value);
+    ++copied;
+  }
+  if (change.get(strings::key_sat, value)) {
+    setSaturation(value);
+    ++copied;
+  }
+  if (change.get(strings::key_ct, value)) {
+    setColorTemp(value);
+    ++copied;
+  }
+  if (change.get(strings::key_transitiontime, value)) {
+    setTransitionTime(value);
+    ++copied;
+  }
+  int32_t delta;
+  if (uint8_t found = getDelta(change, strings::key_bri_inc, strings::key_bri_dec, delta)) {
+    incrementBrightness(delta);
+    copied += found;
+  }
+  if (uint8_t found = getDelta(change, strings::key_sat_inc, strings::key_sat_dec, delta)) {
+    incrementSaturation(delta);
+    copied += found;
+  }
+  if (uint8_t found = getDelta(change, strings::key_hue_inc, strings::key_hue_dec, delta)) {
+    incrementHue(delta);
+    copied += found;
+  }
+  if (uint8_t found = getDelta(change, strings::key_ct_inc, strings::key_ct_dec, delta)) {
+    incrementColorTemp(delta);
+    copied += found;
+  }
+  return copied == change.size();
+}
+
+
+bool StateChangeBuilder::has(Field field) const {
+  return fields_ & (1U << field);
+}
+
+
+uint8_t StateChangeBuilder::size() const {
+  return __builtin_popcount(fields_);
+}
+
+
+void StateChangeBuilder::clear() {
+  fields_ = 0;
+}
+
+
+size_t StateChangeBuilder::serialize(char *dest, size_t size) const {
+  return (size < kMaxJsonSize) ? 0 : write(dest, nullptr);
+}
+
+
+size_t StateChangeBuilder::serialize(char *dest, size_t size, uint8_t (&slots)[FIELD_COUNT]) const {
+  return (size < kMaxJsonSize) ? 0 : write(dest, slots);
+}
+
+
+bool StateChangeBuilder::writeSlot(char *dest, Field field, long value) {
+  const uint8_t width = state_fields::table[field].max_value_length;
+  char digits[SPHUE_FORMAT_INTEGER_SIZE];
+  const char *text = digits;
+  size_t length;
+  if (field == ON) {
+    text = value ? "true" : "false";
+    length = strlen(text);
+  } else {
+    length = json::formatInteger(digits, value);
+  }
+  if (length > width) {
+    return false;
+  }
+  // JSON allows whitespace before a value.
+  memset(dest, ' ', width - length);
+  memcpy(dest + width - length, text, length);
+  return true;
+}
+
+
+void StateChangeBuilder::mark(Field field) {
+  fields_ |= (1U << field);
+}
+
+
+long StateChangeBuilder::value(Field field) const {
+  switch (field) {
+    case BRI:
+      return bri_;
+    case HUE:
+      return hue_;
+    case SAT:
+      return sat_;
+    case CT:
+      return ct_;
+    case TRANSITIONTIME:
+      return transitiontime_;
+    case BRI_INC:
+      return bri_inc_;
+    case SAT_INC:
+      return sat_inc_;
+    case HUE_INC:
+      return hue_inc_;
+    case CT_INC:
+      return ct_inc_;
+    default:
+      return on_;
+  }
+}
+
+
+size_t StateChangeBuilder::write(char *dest, uint8_t *slots) const {
+  if (slots) {
+    memset(slots, kNoSlot, FIELD_COUNT);
+  }
+  char *p = dest;
+  *p++ = '{';
+  for (uint8_t field = 0; field < FIELD_COUNT; ++field) {
+    if (!has((Field) field)) {
+      continue;
+    }
+    if (p != dest + 1) {
+      *p++ = ',';
+    }
+    *p++ = '"';
+    for (const char *key = state_fields::table[field].key; *key; ++key) {
+      *p++ = *key;
+    }
+    *p++ = '"';
+    *p++ = ':';
+    if (slots) {
+      slots[field] = p - dest;
+      writeSlot(p, (Field) field, value((Field) field));
+      p += state_fields::table[field].max_value_length;
+    } else if (field == ON) {
+      const char *literal = on_ ? "true" : "false";
+      while (*literal) {
+        *p++ = *literal++;
+      }
+    } else {
+      p += json::formatInteger(p, value((Field) field));
+    }
+  }
+  *p++ = '}';
+  *p = '\0';
+  return p - dest;
 }
 
 
@@ -553,12 +925,12 @@ const String &Group::name() const {
 }
 
 
-const std::vector<uint8_t> &Group::lights() const {
+const IdList &Group::lights() const {
   return lights_;
 }
 
 
-const std::vector<uint8_t> &Group::sensors() const {
+const IdList &Group::sensors() const {
   return sensors_;
 }
 
@@ -583,29 +955,44 @@ const State &Group::action() const {
 }
 
 
-bool Group::onKey(String &key, json::JsonParser &parser) {
-  STR_EQ_INIT(key.c_str())
-  STR_EQ_RET(strings::key_name, parser.get(name_))
-  STR_EQ_RET(strings::key_lights, parseArrayOfIntStrings(parser, lights_))
-  STR_EQ_RET(strings::key_sensors, parseArrayOfIntStrings(parser, sensors_))
-  STR_EQ_DO(strings::key_type, {
-    String type;
-    bool success = parser.get(type);
-    type_ = typeFromString(type);
-    return success;
-  })
-  STR_EQ_RET(strings::key_state, parser.get(*this))
-  STR_EQ_RET(strings::key_all_on, parser.get(all_on_))
-  STR_EQ_RET(strings::key_any_on, parser.get(any_on_))
-  STR_EQ_RET(strings::key_recycle, parser.get(recycle_))
-  STR_EQ_DO(strings::key_class, {
-    String a_class;
-    bool success = parser.get(a_class);
-    class_ = classFromString(a_class);
-    return success;
-  })
-  STR_EQ_RET(strings::key_action, parser.get(action_))
-  return false;
+const json::JsonKeyTable *Group::keyTable() const {
+  return &group_keys;
+}
+
+
+bool Group::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case GROUP_NAME:
+      return parser.get(name_);
+    case GROUP_LIGHTS:
+      return parseArrayOfIntStrings(parser, lights_);
+    case GROUP_SENSORS:
+      return parseArrayOfIntStrings(parser, sensors_);
+    case GROUP_TYPE: {
+      String type;
+      bool success = parser.get(type);
+      type_ = typeFromString(type);
+      return success;
+    }
+    case GROUP_STATE:
+      return parser.get(*this);
+    case GROUP_ALL_ON:
+      return parser.get(all_on_);
+    case GROUP_ANY_ON:
+      return parser.get(any_on_);
+    case GROUP_RECYCLE:
+      return parser.get(recycle_);
+    case GROUP_CLASS: {
+      String a_class;
+      bool success = parser.get(a_class);
+      class_ = classFromString(a_class);
+      return success;
+    }
+    case GROUP_ACTION:
+      return parser.get(action_);
+    default:
+      return false;
+  }
 }
 
 
@@ -613,17 +1000,28 @@ bool Group::onKey(String &key, json::JsonParser &parser) {
 // Class : GroupAttributeChange ////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-void GroupAttributeChange::addLight(int light_id) {
-  String light_string(light_id);
-  json::JsonString value(light_string);
-  lights_.add(value);
+bool GroupAttributeChange::addLight(int light_id) {
+  if (!isLightId(light_id)) {
+    return false;
+  }
+  lights_.add(light_id);
+  markDirty();
+  return true;
+}
+
+
+bool GroupAttributeChange::removeLight(int light_id) {
+  if (!isLightId(light_id) || !lights_.remove(light_id)) {
+    return false;
+  }
+  markDirty();
+  return true;
 }
 
 
-void GroupAttributeChange::removeLight(int light_id) {
-  String light_string(light_id);
-  json::JsonString value(light_string);
-  lights_.remove(value);
+void GroupAttributeChange::setLights(const IdList &light_ids) {
+  lights_.assign(light_ids.begin(), light_ids.end());
+  markDirty();
 }
 
 
@@ -642,10 +1040,7 @@ void GroupAttributeChange::setRoomClass(Group::Class a_class) {
 
 void GroupAttributeChange::build() {
   String key = read_prog_str(strings::key_lights);
-  if (has(key)) {
-    // TODO: Equality check before remove?
-    remove(key);
-  }
+  // Replaces the previous lights array, if any.
   add(key, lights_);
 }
 
@@ -684,9 +1079,11 @@ void GroupCreationRequest::setRoomClass(Group::Class a_class) {
 // Class : GroupStateChange ////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
+constexpr uint8_t GroupStateChange::kMaxFields;
+
+
 void GroupStateChange::setScene(String &scene) {
-  String key = read_prog_str(strings::key_scene);
-  add(key, scene);
+  set(strings::key_scene, scene);
 }
 
 
@@ -719,7 +1116,7 @@ uint8_t Scene::group() const {
   return group_;
 }
 
-const std::vector<uint8_t> &Scene::lights() const {
+const IdList &Scene::lights() const {
   return lights_;
 }
 
@@ -731,42 +1128,59 @@ bool Scene::locked() const {
   return locked_;
 }
 
-bool Scene::onKey(String &key, json::JsonParser &parser) {
-  STR_EQ_INIT(key.c_str())
-  STR_EQ_RET(strings::key_name, parser.get(name_))
-  STR_EQ_DO(strings::key_type, {
-    String type;
-    bool success = parser.get(type);
-    type_ = typeFromString(type);
-    return success;
-  })
-  STR_EQ_DO(strings::key_group, {
-    String group;
-    bool success = parser.get(group);
-    group_ = group.toInt();
-    return success;
-  })
-  STR_EQ_RET(strings::key_lights, parseArrayOfIntStrings(parser, lights_))
-  STR_EQ_RET(strings::key_recycle, parser.get(recycle_))
-  STR_EQ_RET(strings::key_locked, parser.get(locked_))
-  return false;
+const json::JsonKeyTable *Scene::keyTable() const {
+  return &scene_keys;
+}
+
+bool Scene::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case SCENE_NAME:
+      return parser.get(name_);
+    case SCENE_TYPE: {
+      String type;
+      bool success = parser.get(type);
+      type_ = typeFromString(type);
+      return success;
+    }
+    case SCENE_GROUP:
+      return parser.get(group_);
+    case SCENE_LIGHTS:
+      return parseArrayOfIntStrings(parser, lights_);
+    case SCENE_RECYCLE:
+      return parser.get(recycle_);
+    case SCENE_LOCKED:
+      return parser.get(locked_);
+    default:
+      return false;
+  }
 }
 
 ////////////////////////////////////////////////////////////////
 // Class : SceneAttributeChange ////////////////////////////////
 ////////////////////////////////////////////////////////////////
 
-void SceneAttributeChange::addLight(int light_id) {
-  String light_string(light_id);
-  json::JsonString value(light_string);
-  lights_.add(value);
+bool SceneAttributeChange::addLight(int light_id) {
+  if (!isLightId(light_id)) {
+    return false;
+  }
+  lights_.add(light_id);
+  markDirty();
+  return true;
+}
+
+
+bool SceneAttributeChange::removeLight(int light_id) {
+  if (!isLightId(light_id) || !lights_.remove(light_id)) {
+    return false;
+  }
+  markDirty();
+  return true;
 }
 
 
-void SceneAttributeChange::removeLight(int light_id) {
-  String light_string(light_id);
-  json::JsonString value(light_string);
-  lights_.remove(value);
+void SceneAttributeChange::setLights(const IdList &light_ids) {
+  lights_.assign(light_ids.begin(), light_ids.end());
+  markDirty();
 }
 
 
@@ -784,10 +1198,7 @@ void SceneAttributeChange::setStoreLightState(bool store_light_state) {
 
 void SceneAttributeChange::build() {
   String key = read_prog_str(strings::key_lights);
-  if (has(key)) {
-    // TODO: Equality check before remove?
-    remove(key);
-  }
+  // Replaces the previous lights array, if any.
   add(key, lights_);
 }
 
@@ -797,38 +1208,32 @@ void SceneAttributeChange::build() {
 ////////////////////////////////////////////////////////////////
 
 void SceneStateChange::setOn(bool turned_on) {
-  String key = read_prog_str(strings::key_on);
-  add(key, turned_on);
+  set(strings::key_on, turned_on);
 }
 
 
 void SceneStateChange::setBrightness(uint8_t brightness) {
-  String key = read_prog_str(strings::key_bri);
-  add(key, (int) brightness);
+  set(strings::key_bri, (int) brightness);
 }
 
 
 void SceneStateChange::setHue(uint16_t hue) {
-  String key = read_prog_str(strings::key_hue);
-  add(key, (int) hue);
+  set(strings::key_hue, (int) hue);
 }
 
 
 void SceneStateChange::setSaturation(uint8_t saturation) {
-  String key = read_prog_str(strings::key_sat);
-  add(key, (int) saturation);
+  set(strings::key_sat, (int) saturation);
 }
 
 
 void SceneStateChange::setColorTemp(uint16_t color_temp) {
-  String key = read_prog_str(strings::key_ct);
-  add(key, (int) color_temp);
+  set(strings::key_ct, (int) color_temp);
 }
 
 
 void SceneStateChange::setTransitionTime(uint16_t time_in_tenths_of_seconds) {
-  String key = read_prog_str(strings::key_transitiontime);
-  add(key, (int) time_in_tenths_of_seconds);
+  set(strings::key_transitiontime, (int) time_in_tenths_of_seconds);
 }
 
 }
\ No newline at end of file
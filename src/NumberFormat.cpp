@@ -0,0 +1,421 @@
+#include "NumberFormat.h"
+#include <limits>
+#include <math.h>
+#include <string.h>
+
+namespace json {
+
+namespace {
+
+const char kDigitPairs[] PROGMEM =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+const uint32_t kPowersOfTen[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+
+// Writes `value` as exactly `digits` digits, zero-padded on the left.
+void formatPadded(char *buffer, uint32_t value, uint8_t digits) {
+  char *p = buffer + digits;
+  while (p - buffer >= 2) {
+    p -= 2;
+    memcpy_P(p, kDigitPairs + 2 * (value % 100), 2);
+    value /= 100;
+  }
+  if (p > buffer) {
+    *--p = (char) ('0' + value % 10);
+  }
+}
+
+
+size_t formatUnsigned(char *buffer, uint32_t value) {
+  uint8_t digits = 1;
+  while (digits < 10 && value >= kPowersOfTen[digits]) {
+    ++digits;
+  }
+  formatPadded(buffer, value, digits);
+  return digits;
+}
+
+
+size_t formatUnsigned(char *buffer, uint64_t value) {
+  if (value <= 0xFFFFFFFF) {
+    return formatUnsigned(buffer, (uint32_t) value);
+  }
+  // Callers stay below 10^18, so the high part fits in 32 bits.
+  size_t length = formatUnsigned(buffer, (uint32_t) (value / 1000000000));
+  formatPadded(buffer + length, (uint32_t) (value % 1000000000), 9);
+  return length + 9;
+}
+
+
+////////////////////////////////////////////////////////////////
+// Grisu2 //////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+// Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010. The output
+// always reads back as the input and is the shortest such form in the vast majority of cases.
+
+// A floating point value f * 2^e with a 64 bit significand.
+struct DiyFp {
+  uint64_t f;
+  int e;
+};
+
+
+DiyFp subtract(const DiyFp &x, const DiyFp &y) {
+  return {x.f - y.f, x.e};
+}
+
+
+// The upper 64 bits of the 128 bit product, rounded.
+DiyFp multiply(const DiyFp &x, const DiyFp &y) {
+  const uint64_t x_lo = x.f & 0xFFFFFFFF;
+  const uint64_t x_hi = x.f >> 32;
+  const uint64_t y_lo = y.f & 0xFFFFFFFF;
+  const uint64_t y_hi = y.f >> 32;
+
+  const uint64_t p0 = x_lo * y_lo;
+  const uint64_t p1 = x_lo * y_hi;
+  const uint64_t p2 = x_hi * y_lo;
+  const uint64_t p3 = x_hi * y_hi;
+
+  uint64_t middle = (p0 >> 32) + (p1 & 0xFFFFFFFF) + (p2 & 0xFFFFFFFF);
+  middle += uint64_t{1} << 31;
+  return {p3 + (p2 >> 32) + (p1 >> 32) + (middle >> 32), x.e + y.e + 64};
+}
+
+
+DiyFp normalize(DiyFp x) {
+  while ((x.f >> 63) == 0) {
+    x.f <<= 1;
+    --x.e;
+  }
+  return x;
+}
+
+
+// The value and the midpoints to its neighbours; Any number strictly between them reads back as the value.
+struct Boundaries {
+  DiyFp w;
+  DiyFp minus;
+  DiyFp plus;
+};
+
+
+template<typename Real, typename Bits>
+Boundaries computeBoundaries(Real value) {
+  const int kPrecision = std::numeric_limits<Real>::digits;
+  const int kBias = std::numeric_limits<Real>::max_exponent - 1 + (kPrecision - 1);
+  const int kMinExponent = 1 - kBias;
+  const uint64_t kHiddenBit = uint64_t{1} << (kPrecision - 1);
+
+  Bits bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint64_t biased_exponent = bits >> (kPrecision - 1);
+  const uint64_t fraction = bits & (kHiddenBit - 1);
+
+  const DiyFp v = (biased_exponent == 0)
+      ? DiyFp{fraction, kMinExponent}
+      : DiyFp{fraction + kHiddenBit, (int) biased_exponent - kBias};
+  // At a power of two the gap to the next lower value is half the gap to the next higher one.
+  const bool lower_is_closer = fraction == 0 && biased_exponent > 1;
+  const DiyFp plus = normalize({2 * v.f + 1, v.e - 1});
+  const DiyFp minus = lower_is_closer ? DiyFp{4 * v.f - 1, v.e - 2} : DiyFp{2 * v.f - 1, v.e - 1};
+  return {normalize(v), {minus.f << (minus.e - plus.e), plus.e}, plus};
+}
+
+
+// Scaled products land in [2^kAlpha, 2^kGamma], so their integral part fits in 32 bits.
+const int kAlpha = -60;
+const int kGamma = -32;
+
+struct CachedPower {
+  uint64_t f;
+  int16_t e;
+  int16_t k;
+};
+
+// 10^k normalized to 64 bits, for k = -300, -292, ..., 324.
+const int kCachedPowersMinDecimalExponent = -300;
+const int kCachedPowersDecimalStep = 8;
+const CachedPower kCachedPowers[] PROGMEM = {
+  {0xAB70FE17C79AC6CA, -1060, -300},
+  {0xFF77B1FCBEBCDC4F, -1034, -292},
+  {0xBE5691EF416BD60C, -1007, -284},
+  {0x8DD01FAD907FFC3C, -980, -276},
+  {0xD3515C2831559A83, -954, -268},
+  {0x9D71AC8FADA6C9B5, -927, -260},
+  {0xEA9C227723EE8BCB, -901, -252},
+  {0xAECC49914078536D, -874, -244},
+  {0x823C12795DB6CE57, -847, -236},
+  {0xC21094364DFB5637, -821, -228},
+  {0x9096EA6F3848984F, -794, -220},
+  {0xD77485CB25823AC7, -768, -212},
+  {0xA086CFCD97BF97F4, -741, -204},
+  {0xEF340A98172AACE5, -715, -196},
+  {0xB23867FB2A35B28E, -688, -188},
+  {0x84C8D4DFD2C63F3B, -661, -180},
+  {0xC5DD44271AD3CDBA, -635, -172},
+  {0x936B9FCEBB25C996, -608, -164},
+  {0xDBAC6C247D62A584, -582, -156},
+  {0xA3AB66580D5FDAF6, -555, -148},
+  {0xF3E2F893DEC3F126, -529, -140},
+  {0xB5B5ADA8AAFF80B8, -502, -132},
+  {0x87625F056C7C4A8B, -475, -124},
+  {0xC9BCFF6034C13053, -449, -116},
+  {0x964E858C91BA2655, -422, -108},
+  {0xDFF9772470297EBD, -396, -100},
+  {0xA6DFBD9FB8E5B88F, -369, -92},
+  {0xF8A95FCF88747D94, -343, -84},
+  {0xB94470938FA89BCF, -316, -76},
+  {0x8A08F0F8BF0F156B, -289, -68},
+  {0xCDB02555653131B6, -263, -60},
+  {0x993FE2C6D07B7FAC, -236, -52},
+  {0xE45C10C42A2B3B06, -210, -44},
+  {0xAA242499697392D3, -183, -36},
+  {0xFD87B5F28300CA0E, -157, -28},
+  {0xBCE5086492111AEB, -130, -20},
+  {0x8CBCCC096F5088CC, -103, -12},
+  {0xD1B71758E219652C, -77, -4},
+  {0x9C40000000000000, -50, 4},
+  {0xE8D4A51000000000, -24, 12},
+  {0xAD78EBC5AC620000, 3, 20},
+  {0x813F3978F8940984, 30, 28},
+  {0xC097CE7BC90715B3, 56, 36},
+  {0x8F7E32CE7BEA5C70, 83, 44},
+  {0xD5D238A4ABE98068, 109, 52},
+  {0x9F4F2726179A2245, 136, 60},
+  {0xED63A231D4C4FB27, 162, 68},
+  {0xB0DE65388CC8ADA8, 189, 76},
+  {0x83C7088E1AAB65DB, 216, 84},
+  {0xC45D1DF942711D9A, 242, 92},
+  {0x924D692CA61BE758, 269, 100},
+  {0xDA01EE641A708DEA, 295, 108},
+  {0xA26DA3999AEF774A, 322, 116},
+  {0xF209787BB47D6B85, 348, 124},
+  {0xB454E4A179DD1877, 375, 132},
+  {0x865B86925B9BC5C2, 402, 140},
+  {0xC83553C5C8965D3D, 428, 148},
+  {0x952AB45CFA97A0B3, 455, 156},
+  {0xDE469FBD99A05FE3, 481, 164},
+  {0xA59BC234DB398C25, 508, 172},
+  {0xF6C69A72A3989F5C, 534, 180},
+  {0xB7DCBF5354E9BECE, 561, 188},
+  {0x88FCF317F22241E2, 588, 196},
+  {0xCC20CE9BD35C78A5, 614, 204},
+  {0x98165AF37B2153DF, 641, 212},
+  {0xE2A0B5DC971F303A, 667, 220},
+  {0xA8D9D1535CE3B396, 694, 228},
+  {0xFB9B7CD9A4A7443C, 720, 236},
+  {0xBB764C4CA7A44410, 747, 244},
+  {0x8BAB8EEFB6409C1A, 774, 252},
+  {0xD01FEF10A657842C, 800, 260},
+  {0x9B10A4E5E9913129, 827, 268},
+  {0xE7109BFBA19C0C9D, 853, 276},
+  {0xAC2820D9623BF429, 880, 284},
+  {0x80444B5E7AA7CF85, 907, 292},
+  {0xBF21E44003ACDD2D, 933, 300},
+  {0x8E679C2F5E44FF8F, 960, 308},
+  {0xD433179D9C8CB841, 986, 316},
+  {0x9E19DB92B4E31BA9, 1013, 324},
+};
+
+
+// A cached power c = f * 2^e = 10^k that scales a value with binary exponent `e` into [kAlpha, kGamma].
+CachedPower cachedPowerFor(int e) {
+  const int f = kAlpha - e - 1;
+  // ceil(f * log10(2))
+  const int k = (f * 78913) / (1 << 18) + (int) (f > 0);
+  const int index = (-kCachedPowersMinDecimalExponent + k + (kCachedPowersDecimalStep - 1)) / kCachedPowersDecimalStep;
+  CachedPower cached;
+  memcpy_P(&cached, &kCachedPowers[index], sizeof(cached));
+  return cached;
+}
+
+
+// Nudges the last digit towards `dist`, the distance from the upper boundary to the exact value.
+void roundLastDigit(char *buffer, int length, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k) {
+  while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    --buffer[length - 1];
+    rest += ten_k;
+  }
+}
+
+
+// Generates the digits of M+ until the remainder falls within `delta` of it.
+void generateDigits(char *buffer, int &length, int &exponent, const DiyFp &minus, const DiyFp &w, const DiyFp &plus) {
+  uint64_t delta = subtract(plus, minus).f;
+  uint64_t dist = subtract(plus, w).f;
+
+  const DiyFp one = {uint64_t{1} << -plus.e, plus.e};
+  uint32_t integral = (uint32_t) (plus.f >> -one.e);
+  uint64_t fractional = plus.f & (one.f - 1);
+
+  int digits = 1;
+  while (digits < 10 && integral >= kPowersOfTen[digits]) {
+    ++digits;
+  }
+  while (digits > 0) {
+    const uint32_t power = kPowersOfTen[--digits];
+    buffer[length++] = (char) ('0' + integral / power);
+    integral %= power;
+    const uint64_t rest = ((uint64_t) integral << -one.e) + fractional;
+    if (rest <= delta) {
+      exponent += digits;
+      roundLastDigit(buffer, length, dist, delta, rest, (uint64_t) power << -one.e);
+      return;
+    }
+  }
+
+  for (;;) {
+    fractional *= 10;
+    buffer[length++] = (char) ('0' + (fractional >> -one.e));
+    fractional &= one.f - 1;
+    delta *= 10;
+    dist *= 10;
+    --exponent;
+    if (fractional <= delta) {
+      break;
+    }
+  }
+  roundLastDigit(buffer, length, dist, delta, fractional, one.f);
+}
+
+
+// Writes the shortest digits of `bounds` to `buffer` such that the value is digits * 10^exponent.
+void grisu2(char *buffer, int &length, int &exponent, const Boundaries &bounds) {
+  const CachedPower cached = cachedPowerFor(bounds.plus.e);
+  const DiyFp c = {cached.f, cached.e};
+
+  const DiyFp w = multiply(bounds.w, c);
+  DiyFp minus = multiply(bounds.minus, c);
+  DiyFp plus = multiply(bounds.plus, c);
+  // The products are off by at most one unit; Shrink the interval so that every digit string in it is safe.
+  ++minus.f;
+  --plus.f;
+
+  length = 0;
+  exponent = -cached.k;
+  generateDigits(buffer, length, exponent, minus, w, plus);
+}
+
+
+// Lays out `length` digits worth digits * 10^exponent in place, in plain notation when the decimal point falls within
+// (min_exponent, max_exponent] digits of the front.
+size_t layoutDigits(char *buffer, int length, int exponent, int min_exponent, int max_exponent) {
+  const int point = length + exponent;
+
+  if (length <= point && point <= max_exponent) {
+    // 1234e2 -> 123400
+    memset(buffer + length, '0', point - length);
+    return point;
+  }
+  if (0 < point && point <= max_exponent) {
+    // 1234e-2 -> 12.34
+    memmove(buffer + point + 1, buffer + point, length - point);
+    buffer[point] = '.';
+    return length + 1;
+  }
+  if (min_exponent < point && point <= 0) {
+    // 1234e-6 -> 0.001234
+    memmove(buffer + 2 - point, buffer, length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(buffer + 2, '0', -point);
+    return 2 - point + length;
+  }
+
+  // 1234e30 -> 1.234e33
+  size_t written = 1;
+  if (length > 1) {
+    memmove(buffer + 2, buffer + 1, length - 1);
+    buffer[1] = '.';
+    written = length + 1;
+  }
+  buffer[written++] = 'e';
+  int scientific = point - 1;
+  if (scientific < 0) {
+    buffer[written++] = '-';
+    scientific = -scientific;
+  }
+  return written + formatUnsigned(buffer + written, (uint32_t) scientific);
+}
+
+
+size_t formatShortest(char *buffer, double value, bool single) {
+  char *p = buffer;
+  if (value < 0) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (value == 0) {
+    *p++ = '0';
+    return p - buffer;
+  }
+
+  int length;
+  int exponent;
+  if (single) {
+    grisu2(p, length, exponent, computeBoundaries<float, uint32_t>((float) value));
+    return (p - buffer) + layoutDigits(p, length, exponent, -4, std::numeric_limits<float>::digits10);
+  }
+  grisu2(p, length, exponent, computeBoundaries<double, uint64_t>(value));
+  return (p - buffer) + layoutDigits(p, length, exponent, -4, std::numeric_limits<double>::digits10);
+}
+
+
+// Returns 0 when the scaled value is too large for the fast path.
+size_t formatFixed(char *buffer, double value, uint8_t precision) {
+  const bool negative = value < 0;
+  const double scaled = (negative ? -value : value) * kPowersOfTen[precision] + 0.5;
+  if (scaled >= 1e18) {
+    return 0;
+  }
+  const uint64_t units = (uint64_t) scaled;
+
+  char *p = buffer;
+  if (negative && units) {
+    *p++ = '-';
+  }
+  p += formatUnsigned(p, units / kPowersOfTen[precision]);
+  uint32_t fraction = (uint32_t) (units % kPowersOfTen[precision]);
+  if (fraction) {
+    while (fraction % 10 == 0) {
+      fraction /= 10;
+      --precision;
+    }
+    *p++ = '.';
+    formatPadded(p, fraction, precision);
+    p += precision;
+  }
+  return p - buffer;
+}
+
+}
+
+
+size_t formatInteger(char *buffer, int32_t value) {
+  if (value < 0) {
+    buffer[0] = '-';
+    return 1 + formatUnsigned(buffer + 1, -(uint32_t) value);
+  }
+  return formatUnsigned(buffer, (uint32_t) value);
+}
+
+
+size_t formatReal(char *buffer, double value, int8_t precision, bool single) {
+  if (isnan(value) || isinf(value)) {
+    memcpy(buffer, "null", 4);
+    return 4;
+  }
+  if (precision >= 0) {
+    size_t length = formatFixed(buffer, value, precision > 9 ? 9 : precision);
+    if (length) {
+      return length;
+    }
+  }
+  return formatShortest(buffer, value, single);
+}
+
+}
@@ -0,0 +1,169 @@
+#include "Scheduler.h"
+
+namespace sphue {
+
+////////////////////////////////////////////////////////////////
+// Class : TokenBucket /////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+TokenBucket::TokenBucket(uint16_t rate, uint8_t burst) {
+  configure(rate, burst);
+}
+
+
+void TokenBucket::configure(uint16_t rate, uint8_t burst) {
+  rate_ = rate;
+  capacity_ = (burst ? burst : 1) * 1000UL;
+  tokens_ = capacity_;
+  refilled_ = millis();
+}
+
+
+bool TokenBucket::ready() {
+  // Unlimited; refill() would divide by the rate.
+  if (rate_ == 0) {
+    return true;
+  }
+  refill();
+  return tokens_ >= 1000;
+}
+
+
+bool TokenBucket::take() {
+  if (!ready()) {
+    return false;
+  }
+  if (rate_) {
+    tokens_ -= 1000;
+  }
+  return true;
+}
+
+
+void TokenBucket::refill() {
+  const unsigned long now = millis();
+  const unsigned long elapsed = now - refilled_;
+  refilled_ = now;
+  // Compared before multiplying, as a long idle time times the rate could overflow.
+  if (elapsed >= (capacity_ - tokens_) / rate_ + 1) {
+    tokens_ = capacity_;
+  } else {
+    tokens_ += elapsed * rate_;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////
+// Class : Scheduler ///////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+
+Scheduler::Scheduler(Sphue &sphue, Policy policy, uint8_t capacity)
+    : sphue_(sphue),
+      lights_(SPHUE_SCHEDULER_LIGHT_RATE, 1),
+      groups_(SPHUE_SCHEDULER_GROUP_RATE, 1),
+      policy_(policy),
+      capacity_(capacity ? capacity : 1) {
+  //
+}
+
+
+void Scheduler::setLightRate(uint16_t rate, uint8_t burst) {
+  lights_.configure(rate, burst);
+}
+
+
+void Scheduler::setGroupRate(uint16_t rate, uint8_t burst) {
+  groups_.configure(rate, burst);
+}
+
+
+void Scheduler::setLightState(int id, const LightStateChange &change) {
+  queue(false, id, change);
+}
+
+
+void Scheduler::setGroupState(int id, const GroupStateChange &change) {
+  queue(true, id, change);
+}
+
+
+void Scheduler::poll() {
+  sphue_.poll();
+  if (!busy_) {
+    sendNext();
+  }
+}
+
+
+const Scheduler::Counters &Scheduler::counters() const {
+  return counters_;
+}
+
+
+size_t Scheduler::size() const {
+  return queue_.size();
+}
+
+
+void Scheduler::queue(bool group, int id, const LightStateChange &change) {
+  ++counters_.queued;
+  if (policy_ == COALESCE && coalesce(group, id, change)) {
+    return;
+  }
+  if (queue_.size() >= capacity_) {
+    queue_.pop_front();
+    ++counters_.dropped;
+  }
+  queue_.emplace_back();
+  Command &command = queue_.back();
+  command.group = group;
+  command.id = id;
+  command.change.merge(change);
+}
+
+
+bool Scheduler::coalesce(bool group, int id, const LightStateChange &change) {
+  // The newest command for the same target; A command already in flight is not in the queue, and the change waits
+  // for the next one.
+  for (auto command = queue_.rbegin(); command != queue_.rend(); ++command) {
+    if (command->group == group && command->id == id) {
+      // Merged in place; A GroupStateChange has room for every key a change can set, so the merge always fits whole.
+      static_assert(SPHUE_JSON_COMPACT_SIZE >= GroupStateChange::kMaxFields, "A merged change may not fit");
+      command->change.merge(change);
+      ++counters_.coalesced;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void Scheduler::sendNext() {
+  // The oldest command whose class has a token; A group command waiting on its token doesn't hold up the lights.
+  for (auto command = queue_.begin(); command != queue_.end(); ++command) {
+    TokenBucket &bucket = command->group ? groups_ : lights_;
+    if (!bucket.take()) {
+      continue;
+    }
+    busy_ = true;
+    ++counters_.sent;
+    auto done = [this](const ResultSummary &summary) {
+      busy_ = false;
+      if (!summary) {
+        ++counters_.failed;
+      }
+    };
+    // Sent straight from the queue; The call keeps a copy of the serialized body, so the command can go right after.
+    if (command->group) {
+      sphue_.setGroupStateAsync(command->id, command->change, done);
+    } else {
+      sphue_.setLightStateAsync(command->id, command->change, done);
+    }
+    queue_.erase(command);
+    // Writes the request right away.
+    sphue_.poll();
+    return;
+  }
+}
+
+}
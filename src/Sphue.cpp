@@ -1,6 +1,4 @@
 #include "Sphue.h"
-#include <sstream>
-#include "prog_str.h"
 
 #ifdef SPHUE_EXAMPLE_PROJECT
 #include <iostream>
@@ -16,8 +14,6 @@
 
 namespace sphue {
 
-const char *endpoint_prefix = "api";
-
 namespace strings {
 const char endpoint_lights[] PROGMEM = "lights";
 const char endpoint_groups[] PROGMEM = "groups";
@@ -48,11 +44,101 @@ Sphue autoDiscoverHub(const char *hubId) {
   return Sphue(nullptr);
 }
 
+constexpr size_t Path::kSize;
+
+Path::Path(const char *prefix, size_t length) : length_(0) {
+  char *dest = reserve(length);
+  if (dest) {
+    memcpy(dest, prefix, length);
+  }
+}
+
+Path &Path::collection(const char *name) {
+  const size_t length = strlen_P(name);
+  char *dest = reserve(1 + length);
+  if (dest) {
+    *dest = '/';
+    memcpy_P(dest + 1, name, length);
+  }
+  return *this;
+}
+
+Path &Path::id(int id) {
+  char digits[SPHUE_FORMAT_INTEGER_SIZE];
+  const size_t length = json::formatInteger(digits, id);
+  char *dest = reserve(1 + length);
+  if (dest) {
+    *dest = '/';
+    memcpy(dest + 1, digits, length);
+  }
+  return *this;
+}
+
+Path &Path::leaf(const char *name) {
+  const size_t length = strlen(name);
+  char *dest = reserve(1 + length);
+  if (dest) {
+    *dest = '/';
+    memcpy(dest + 1, name, length);
+  }
+  return *this;
+}
+
+const char *Path::c_str() const {
+  return value_;
+}
+
+size_t Path::length() const {
+  return length_;
+}
+
+char *Path::reserve(size_t length) {
+  // Leaves the path as it was if the segment doesn't fit, so a cut-short path never reaches a different resource.
+  if (length_ + length >= kSize) {
+    value_[length_] = '\0';
+    return nullptr;
+  }
+  char *dest = value_ + length_;
+  length_ += length;
+  value_[length_] = '\0';
+  return dest;
+}
+
+bool PreparedCommand::set(StateChangeBuilder::Field field, long value) {
+  if (!length_ || field >= StateChangeBuilder::FIELD_COUNT || slots_[field] == StateChangeBuilder::kNoSlot) {
+    return false;
+  }
+  if (value < state_fields::table[field].min || value > state_fields::table[field].max) {
+    return false;
+  }
+  return StateChangeBuilder::writeSlot(body_ + slots_[field], field, value);
+}
+
+bool PreparedCommand::setOn(bool turned_on) {
+  return set(StateChangeBuilder::ON, turned_on);
+}
+
+const char *PreparedCommand::path() const {
+  return path_;
+}
+
+const char *PreparedCommand::body() const {
+  return body_;
+}
+
+size_t PreparedCommand::length() const {
+  return length_;
+}
+
+PreparedCommand::operator bool() const {
+  return length_ != 0;
+}
+
 Sphue::Sphue(const char *apiKey, const char *hostname, int port) : Sphue(hostname, port) {
   setApiKey(apiKey);
 }
 
-Sphue::Sphue(const char *hostname, int port) : client_(hostname, port) {
+Sphue::Sphue(const char *hostname, int port) : client_(hostname, port), hostname_(hostname), port_(port) {
   //
 }
 
@@ -62,6 +148,9 @@ const char *Sphue::getApiKey() {
 
 void Sphue::setApiKey(const char *apiKey) {
   apiKey_ = apiKey;
+  // Requests are made under this prefix, so it is formatted once here rather than on every call.
+  int length = snprintf(prefix_, sizeof(prefix_), apiKey ? "/api/%s" : "/api", apiKey);
+  prefix_length_ = (length < 0) ? 0 : ((size_t) length < sizeof(prefix_) ? length : sizeof(prefix_) - 1);
 }
 
 void Sphue::setInsecure() {
@@ -76,6 +165,22 @@ void Sphue::setSslFingerprint(const char *fingerprint) {
   client_.setFingerprint(fingerprint);
 }
 
+void Sphue::setArenaSize(size_t size) {
+  arena_size_ = size;
+}
+
+void Sphue::setClient(Client &client) {
+  connection_ = std::make_shared<http::Connection>(client, hostname_.c_str(), port_);
+  connection_->setIdleTimeout(idle_timeout_);
+}
+
+void Sphue::setIdleTimeout(unsigned long timeout) {
+  idle_timeout_ = timeout;
+  if (connection_) {
+    connection_->setIdleTimeout(timeout);
+  }
+}
+
 template<typename T>
 bool Sphue::parseSingleResponse(Stream &response_stream, Response<T> &dest) {
   json::JsonParser parser(response_stream);
@@ -83,9 +188,8 @@ bool Sphue::parseSingleResponse(Stream &response_stream, Response<T> &dest) {
     json::JsonArrayIterator<Response<T>> array = parser.iterateArray<Response<T>>();
     return array.hasNext() && array.getNext(dest);
   } else {
-    T response;
-    bool success = parser.get(response);
-    dest = Response<T>(response);
+    bool success = parser.get(dest.result_);
+    dest.result_code_ = ResultCode::OK;
     return success;
   }
 }
@@ -101,7 +205,8 @@ bool Sphue::parseFirstResponse(Stream &response_stream, Response<T> &dest) {
 template<typename T>
 std::vector<Response<T>> Sphue::parseResponses(Stream &response_stream, int size) {
   json::JsonParser parser(response_stream);
-  std::vector<Response<T>> result(size);
+  std::vector<Response<T>> result;
+  result.reserve(size);
   json::JsonArrayIterator<Response<T>> array = parser.iterateArray<Response<T>>();
   while (array.hasNext()) {
     Response<T> response;
@@ -112,156 +217,728 @@ std::vector<Response<T>> Sphue::parseResponses(Stream &response_stream, int size
   return result;
 }
 
-String Sphue::buildEndpoint(std::stringstream &string_builder) {
-  return String(string_builder.str().c_str());
+Path Sphue::endpoint(const char *collection) const {
+  Path path(prefix_, prefix_length_);
+  path.collection(collection);
+  return path;
 }
 
-template<typename T, typename... Args>
-String Sphue::buildEndpoint(std::stringstream &string_builder, T &value, Args &... args) {
-  string_builder << '/' << value;
-  return buildEndpoint(string_builder, args...);
+Path Sphue::endpoint(const char *collection, const char *leaf) const {
+  Path path(prefix_, prefix_length_);
+  path.collection(collection).leaf(leaf);
+  return path;
 }
 
-template<typename... Args>
-String Sphue::makeEndpoint(Args &... args) {
-  std::stringstream ss;
-  return buildEndpoint(ss, args...);
+Path Sphue::endpoint(const char *collection, int id, const char *leaf) const {
+  Path path(prefix_, prefix_length_);
+  path.collection(collection).id(id);
+  if (leaf) {
+    path.leaf(leaf);
+  }
+  return path;
 }
 
-template<typename T, typename... Endpoint>
-Response<T> Sphue::get(Endpoint... args) {
-  auto result = client_.get(makeEndpoint(args...).c_str());
+template<typename T>
+Response<T> Sphue::get(const Path &path) {
+  std::shared_ptr<Arena> arena;
+  if (arena_size_) {
+    arena = std::make_shared<Arena>(arena_size_);
+  }
+  // The response is created in the scope, so that its containers draw from the arena.
+  ArenaScope scope(arena);
   Response<T> response;
+  response.arena_ = std::move(arena);
+  if (connection_) {
+    parseSingleResponse(connection_->send("GET", path.c_str(), nullptr), response);
+    connection_->finish();
+    return response;
+  }
+  auto result = client_.get(path.c_str());
   parseSingleResponse(result, response);
   result.finish();
   return response;
 }
 
-template<typename T, typename... Endpoint>
-Response<T> Sphue::post(json::JsonObject *body, Endpoint... args) {
-  auto result = client_.post(makeEndpoint(args...).c_str(), (body ? body->toJson().c_str() : ""));
+template<typename T>
+bool Sphue::forEach(T &model, const Path &path) {
+  if (connection_) {
+    json::JsonParser parser(connection_->send("GET", path.c_str(), nullptr));
+    bool success = parser.get(model);
+    connection_->finish();
+    return success;
+  }
+  auto result = client_.get(path.c_str());
+  json::JsonParser parser(result);
+  bool success = parser.get(model);
+  result.finish();
+  return success;
+}
+
+bool Sphue::stream(json::JsonHandler &handler, const Path &path) {
+  if (connection_) {
+    json::JsonParser parser(connection_->send("GET", path.c_str(), nullptr));
+    bool success = parser.parse(handler);
+    connection_->finish();
+    return success;
+  }
+  auto result = client_.get(path.c_str());
+  json::JsonParser parser(result);
+  bool success = parser.parse(handler);
+  result.finish();
+  return success;
+}
+
+bool Sphue::project(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback,
+                    const Path &path) {
+  if (connection_) {
+    json::JsonParser parser(connection_->send("GET", path.c_str(), nullptr));
+    bool success = parser.project(paths, count, callback);
+    connection_->finish();
+    return success;
+  }
+  auto result = client_.get(path.c_str());
+  json::JsonParser parser(result);
+  bool success = parser.project(paths, count, callback);
+  result.finish();
+  return success;
+}
+
+template<typename T>
+Response<T> Sphue::post(json::JsonSerializable *body, const Path &path) {
   Response<T> response;
+  if (connection_) {
+    parseFirstResponse(connection_->send("POST", path.c_str(), body), response);
+    connection_->finish();
+    return response;
+  }
+  auto result = client_.post(path.c_str(), (body ? body->toJson().c_str() : ""));
   parseFirstResponse(result, response);
   result.finish();
   return response;
 }
 
-template<typename... Endpoint>
-std::vector<Response<NamedValue>> Sphue::post(json::JsonObject *body, Endpoint... args) {
-  auto result = client_.post(makeEndpoint(args...).c_str(), (body ? body->toJson().c_str() : ""));
-  std::vector<Response<NamedValue>> response = parseResponses<NamedValue>(result, (body ? body->size() : 0));
+template<typename Body>
+std::vector<Response<NamedValue>> Sphue::post(Body *body, const Path &path) {
+  // Changes are resent often; Their cached body is only rebuilt after a setter changes a value.
+  const String &json = body->serializedBody();
+  if (connection_) {
+    std::vector<Response<NamedValue>> response =
+        parseResponses<NamedValue>(connection_->send("POST", path.c_str(), json.c_str(), json.length()), body->size());
+    connection_->finish();
+    return response;
+  }
+  auto result = client_.post(path.c_str(), json.c_str());
+  std::vector<Response<NamedValue>> response = parseResponses<NamedValue>(result, body->size());
   result.finish();
   return response;
 }
 
-template<typename... Endpoint>
-std::vector<Response<NamedValue>> Sphue::put(json::JsonObject *body, Endpoint... args) {
-  auto result = client_.put(makeEndpoint(args...).c_str(), (body ? body->toJson().c_str() : ""));
-  std::vector<Response<NamedValue>> response = parseResponses<NamedValue>(result, (body ? body->size() : 0));
+template<typename Body>
+std::vector<Response<NamedValue>> Sphue::put(Body *body, const Path &path) {
+  const String &json = body->serializedBody();
+  if (connection_) {
+    std::vector<Response<NamedValue>> response =
+        parseResponses<NamedValue>(connection_->send("PUT", path.c_str(), json.c_str(), json.length()), body->size());
+    connection_->finish();
+    return response;
+  }
+  auto result = client_.put(path.c_str(), json.c_str());
+  std::vector<Response<NamedValue>> response = parseResponses<NamedValue>(result, body->size());
   result.finish();
   return response;
 }
 
-template<typename... Endpoint>
-Response<String> Sphue::del(Endpoint... args) {
-  auto result = client_.del(makeEndpoint(args...).c_str());
+Response<String> Sphue::del(const Path &path) {
   Response<String> response;
+  if (connection_) {
+    parseFirstResponse(connection_->send("DELETE", path.c_str(), nullptr), response);
+    connection_->finish();
+    return response;
+  }
+  auto result = client_.del(path.c_str());
   parseFirstResponse(result, response);
   result.finish();
   return response;
 }
 
+ResultSummary::ResultSummary(bool keep_error_address) : keep_error_address_(keep_error_address) {
+  //
+}
+
+uint32_t ResultSummary::successes() const {
+  return successes_;
+}
+
+uint8_t ResultSummary::count() const {
+  return count_;
+}
+
+uint16_t ResultSummary::firstError() const {
+  return first_error_;
+}
+
+const String &ResultSummary::errorAddress() const {
+  return error_address_;
+}
+
+ResultSummary::operator bool() const {
+  if (first_error_ != ResultCode::OK || count_ != expected_) {
+    return false;
+  }
+  const uint32_t all = count_ >= 32 ? 0xFFFFFFFF : (((uint32_t) 1) << count_) - 1;
+  return successes_ == all;
+}
+
+void ResultSummary::read(Stream &response_stream, uint8_t expected) {
+  begin(expected);
+  char buffer[64];
+  json::JsonParser parser(response_stream, buffer, sizeof(buffer));
+  json::JsonArrayIterator<ResultSummary> array = parser.iterateArray<ResultSummary>();
+  while (array.hasNext() && array.getNext(*this)) {
+    next();
+  }
+  end();
+}
+
+void ResultSummary::begin(uint8_t expected) {
+  fail(expected);
+  first_error_ = ResultCode::OK;
+}
+
+void ResultSummary::next() {
+  if (count_ < 0xFF) {
+    ++count_;
+  }
+}
+
+void ResultSummary::end() {
+  // An empty or unreadable response is a failure as well.
+  if (count_ == 0 && first_error_ == ResultCode::OK) {
+    first_error_ = ResultCode::UNKNOWN;
+  }
+}
+
+void ResultSummary::fail(uint8_t expected) {
+  successes_ = 0;
+  count_ = 0;
+  expected_ = expected;
+  first_error_ = ResultCode::UNKNOWN;
+  error_address_ = "";
+}
+
+const json::JsonKeyTable *ResultSummary::keyTable() const {
+  return &response_keys;
+}
+
+bool ResultSummary::onField(uint8_t field, json::JsonParser &parser) {
+  switch (field) {
+    case RESPONSE_SUCCESS:
+      if (count_ < 32) {
+        successes_ |= ((uint32_t) 1) << count_;
+      }
+      // The echoed value is skipped.
+      return false;
+    case RESPONSE_ERROR: {
+      // Only the first error is read; The rest are skipped.
+      if (first_error_ != ResultCode::OK) {
+        return false;
+      }
+      first_error_ = ResultCode::UNKNOWN;
+      in_error_ = true;
+      bool success = parser.get(*this);
+      in_error_ = false;
+      return success;
+    }
+    case RESPONSE_TYPE:
+      return in_error_ && parser.get(first_error_);
+    case RESPONSE_ADDRESS:
+      return in_error_ && keep_error_address_ && parser.get(error_address_);
+    default:
+      return false;
+  }
+}
+
+// A queued asynchronous call; The request as it will be sent, and the response as poll() reads it.
+class Sphue::Call {
+ public:
+  Call(const char *method, const Path &path) : method(method), started(0), sent(false), retried(false) {
+    memcpy(this->path, path.c_str(), path.length() + 1);
+  }
+  virtual ~Call() = default;
+
+  // Parses the complete response, or reports a failure if `body` is nullptr, and calls back.
+  virtual void complete(Sphue &sphue, Stream *body) = 0;
+
+  const char *method;
+  char path[Path::kSize];
+  String body;
+  http::AsyncResponse response;
+  unsigned long started;
+  bool sent;
+  bool retried;
+};
+
+template<typename T>
+class Sphue::ResponseCall : public Sphue::Call {
+ public:
+  ResponseCall(const Path &path, const Callback<T> &callback) : Call("GET", path), callback_(callback) {
+    //
+  }
+
+  void complete(Sphue &sphue, Stream *body) override {
+    Response<T> response = parse(sphue, body);
+    callback_(response);
+  }
+
+ private:
+  Callback<T> callback_;
+
+  // The response is created in the scope, so that its containers draw from the arena.
+  static Response<T> parse(Sphue &sphue, Stream *body) {
+    std::shared_ptr<Arena> arena;
+    if (body && sphue.arena_size_) {
+      arena = std::make_shared<Arena>(sphue.arena_size_);
+    }
+    ArenaScope scope(arena);
+    Response<T> response;
+    response.arena_ = std::move(arena);
+    if (body) {
+      sphue.parseSingleResponse(*body, response);
+    }
+    return response;
+  }
+};
+
+// Summarizes the response as it arrives; Nothing of the body is kept.
+class Sphue::SummaryCall : public Sphue::Call, public json::JsonHandler {
+ public:
+  SummaryCall(const Path &path, const String &body, uint8_t fields, const SummaryCallback &callback)
+      : Call("PUT", path), parser_(*this), fields_(fields), callback_(callback) {
+    this->body = body;
+    response.setParser(&parser_);
+  }
+
+  void complete(Sphue &sphue, Stream *body) override {
+    if (body && parser_.status() == json::JsonPushParser::COMPLETE) {
+      summary_.end();
+    } else {
+      summary_.fail(fields_);
+    }
+    callback_(summary_);
+  }
+
+  // Entries are the objects of the top-level array, at depth 2; Error fields are one level below.
+  bool onStartArray() override {
+    if (depth_++ == 0) {
+      summary_.begin(fields_);
+    }
+    return true;
+  }
+
+  bool onEndArray() override {
+    --depth_;
+    return true;
+  }
+
+  bool onStartObject() override {
+    ++depth_;
+    return true;
+  }
+
+  bool onEndObject() override {
+    if (depth_-- == 2) {
+      summary_.next();
+    }
+    field_ = NONE;
+    return true;
+  }
+
+  bool onKey(const String &key) override {
+    field_ = NONE;
+    if (depth_ == 2) {
+      in_error_ = false;
+      if (strcmp_P(key.c_str(), strings::key_success) == 0) {
+        if (summary_.count_ < 32) {
+          summary_.successes_ |= ((uint32_t) 1) << summary_.count_;
+        }
+      } else if (strcmp_P(key.c_str(), strings::key_error) == 0) {
+        // Only the first error is read.
+        in_error_ = summary_.first_error_ == ResultCode::OK;
+        if (in_error_) {
+          summary_.first_error_ = ResultCode::UNKNOWN;
+        }
+      }
+    } else if (depth_ == 3 && in_error_) {
+      if (strcmp_P(key.c_str(), strings::key_type) == 0) {
+        field_ = TYPE;
+      } else if (strcmp_P(key.c_str(), strings::key_address) == 0) {
+        field_ = ADDRESS;
+      }
+    }
+    return true;
+  }
+
+  bool onInteger(long value) override {
+    if (field_ == TYPE) {
+      summary_.first_error_ = (uint16_t) value;
+    }
+    return true;
+  }
+
+  bool onString(const String &value) override {
+    if (field_ == ADDRESS && summary_.keep_error_address_) {
+      summary_.error_address_ = value;
+    }
+    return true;
+  }
+
+ private:
+  enum Field : uint8_t {
+    NONE,
+    TYPE,
+    ADDRESS
+  };
+
+  json::JsonPushParser parser_;
+  ResultSummary summary_;
+  uint8_t fields_;
+  uint8_t depth_ = 0;
+  Field field_ = NONE;
+  bool in_error_ = false;
+  SummaryCallback callback_;
+};
+
+void Sphue::queue(Call *call) {
+  calls_.emplace_back(call);
+}
+
+bool Sphue::putState(const Path &path, const StateChangeBuilder &change) {
+  // Path and body are built on the stack and the response is only tallied, so nothing here allocates.
+  char body[StateChangeBuilder::kMaxJsonSize];
+  size_t length = change.serialize(body);
+  return putBody(path.c_str(), body, length, change.size());
+}
+
+PreparedCommand Sphue::prepareState(const Path &path, const StateChangeBuilder &change) {
+  PreparedCommand command;
+  memcpy(command.path_, path.c_str(), path.length() + 1);
+  command.length_ = change.serialize(command.body_, sizeof(command.body_), command.slots_);
+  command.fields_ = change.size();
+  return command;
+}
+
+bool Sphue::putBody(const char *path, const char *body, size_t length, uint8_t fields) {
+  ResultSummary summary;
+  return sendBody("PUT", path, body, length, fields, summary);
+}
+
+bool Sphue::sendBody(const char *method, const char *path, const char *body, size_t length, uint8_t fields,
+                     ResultSummary &summary) {
+  if (connection_) {
+    summary.read(connection_->send(method, path, body, length), fields);
+    connection_->finish();
+  } else {
+    auto result = strcmp(method, "PUT") == 0 ? client_.put(path, body) : client_.post(path, body);
+    summary.read(result, fields);
+    result.finish();
+  }
+  return (bool) summary;
+}
+
 Response<Lights> Sphue::getAllLights() {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return get<Lights>(endpoint_prefix, apiKey_, endpoint.c_str());
+  return get<Lights>(endpoint(strings::endpoint_lights));
 }
 
 Response<NewLights> Sphue::getNewLights() {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return get<NewLights>(endpoint_prefix, apiKey_, endpoint.c_str(), "new");
+  return get<NewLights>(endpoint(strings::endpoint_lights, "new"));
 }
 
 Response<NamedValue> Sphue::searchForNewLights() {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return post<NamedValue>(nullptr, endpoint_prefix, apiKey_, endpoint.c_str());
+  return post<NamedValue>(nullptr, endpoint(strings::endpoint_lights));
 }
 
 Response<Light> Sphue::getLight(int id) {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return get<Light>(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return get<Light>(endpoint(strings::endpoint_lights, id));
 }
 
 Response<NamedValue> Sphue::renameLight(int id, String &new_name) {
   json::JsonObject json;
   String key = "name";
   json.add(key, new_name);
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return post<NamedValue>(&json, endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return post<NamedValue>(&json, endpoint(strings::endpoint_lights, id));
 }
 
 std::vector<Response<NamedValue>> Sphue::setLightState(int id, LightStateChange &change) {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return put(&change, endpoint_prefix, apiKey_, endpoint.c_str(), id, "state");
+  return put(&change, endpoint(strings::endpoint_lights, id, "state"));
+}
+
+bool Sphue::setLightState(int id, LightStateChange &change, ResultSummary &summary) {
+  const String &json = change.serializedBody();
+  return sendBody("PUT", endpoint(strings::endpoint_lights, id, "state").c_str(), json.c_str(), json.length(),
+                  change.size(), summary);
+}
+
+bool Sphue::setLightState(int id, const StateChangeBuilder &change) {
+  return putState(endpoint(strings::endpoint_lights, id, "state"), change);
+}
+
+std::vector<ResultSummary> Sphue::setLightStates(const std::vector<std::pair<int, LightStateChange *>> &changes) {
+  std::vector<ResultSummary> results(changes.size());
+  if (!connection_) {
+    for (size_t i = 0; i < changes.size(); ++i) {
+      setLightState(changes[i].first, *changes[i].second, results[i]);
+    }
+    return results;
+  }
+  size_t written = 0;
+  size_t received = 0;
+  // Where the batch was last resumed on a new connection; A new connection that answers nothing ends the batch.
+  size_t resumed = changes.size();
+  while (received < changes.size()) {
+    for (; written < changes.size() && written - received < SPHUE_HTTP_PIPELINE_DEPTH; ++written) {
+      const String &json = changes[written].second->serializedBody();
+      Path path = endpoint(strings::endpoint_lights, changes[written].first, "state");
+      if (!connection_->write("PUT", path.c_str(), json.c_str(), json.length())) {
+        break;
+      }
+    }
+    results[received].read(connection_->receive(), changes[received].second->size());
+    connection_->finish();
+    if (connection_->dropped()) {
+      if (resumed == received) {
+        for (; received < changes.size(); ++received) {
+          results[received].fail(changes[received].second->size());
+        }
+        break;
+      }
+      resumed = received;
+    } else if (connection_->statusCode() == 0) {
+      // No answer in time; The bridge may have acted on it and on the requests written behind it, so none is resent.
+      for (; received < changes.size(); ++received) {
+        results[received].fail(changes[received].second->size());
+      }
+      break;
+    } else {
+      ++received;
+    }
+    // Requests written ahead on a connection that has since closed went unanswered; They are sent again on a new one.
+    written = received + connection_->pending();
+  }
+  return results;
 }
 
 Response<String> Sphue::deleteLight(int id) {
-  String endpoint = read_prog_str(strings::endpoint_lights);
-  return del(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return del(endpoint(strings::endpoint_lights, id));
 }
 
 Response<Groups> Sphue::getAllGroups() {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return get<Groups>(endpoint_prefix, apiKey_, endpoint.c_str());
+  return get<Groups>(endpoint(strings::endpoint_groups));
 }
 
 Response<NamedValue> Sphue::createGroup(GroupCreationRequest &request) {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return post<NamedValue>(&request, endpoint_prefix, apiKey_, endpoint.c_str());
+  return post<NamedValue>(&request, endpoint(strings::endpoint_groups));
 }
 
 Response<Group> Sphue::getGroup(int id) {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return get<Group>(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return get<Group>(endpoint(strings::endpoint_groups, id));
 }
 
 std::vector<Response<NamedValue>> Sphue::setGroupAttributes(int id, GroupAttributeChange &change) {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return post(&change, endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return post(&change, endpoint(strings::endpoint_groups, id));
+}
+
+bool Sphue::setGroupAttributes(int id, GroupAttributeChange &change, ResultSummary &summary) {
+  const String &json = change.serializedBody();
+  return sendBody("POST", endpoint(strings::endpoint_groups, id).c_str(), json.c_str(), json.length(), change.size(),
+                  summary);
 }
 
 std::vector<Response<NamedValue>> Sphue::setGroupState(int id, GroupStateChange &change) {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return put(&change, endpoint_prefix, apiKey_, endpoint.c_str(), id, "action");
+  return put(&change, endpoint(strings::endpoint_groups, id, "action"));
+}
+
+bool Sphue::setGroupState(int id, GroupStateChange &change, ResultSummary &summary) {
+  const String &json = change.serializedBody();
+  return sendBody("PUT", endpoint(strings::endpoint_groups, id, "action").c_str(), json.c_str(), json.length(),
+                  change.size(), summary);
+}
+
+bool Sphue::setGroupState(int id, const StateChangeBuilder &change) {
+  return putState(endpoint(strings::endpoint_groups, id, "action"), change);
 }
 
 Response<String> Sphue::deleteGroup(int id) {
-  String endpoint = read_prog_str(strings::endpoint_groups);
-  return del(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return del(endpoint(strings::endpoint_groups, id));
 }
 
 Response<Scenes> Sphue::getAllScenes() {
-  String endpoint = read_prog_str(strings::endpoint_scenes);
-  return get<Scenes>(endpoint_prefix, apiKey_, endpoint.c_str());
+  return get<Scenes>(endpoint(strings::endpoint_scenes));
 }
 
 Response<NamedValue> Sphue::createScene(SceneCreationRequest &request) {
-  String endpoint = read_prog_str(strings::endpoint_scenes);
-  return post<NamedValue>(&request, endpoint_prefix, apiKey_, endpoint.c_str());
+  return post<NamedValue>(&request, endpoint(strings::endpoint_scenes));
 }
 
 Response<Scene> Sphue::getScene(int id) {
-  String endpoint = read_prog_str(strings::endpoint_scenes);
-  return get<Scene>(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return get<Scene>(endpoint(strings::endpoint_scenes, id));
 }
 
 std::vector<Response<NamedValue>> Sphue::modifyScene(int id, SceneModificationRequest &change) {
-  String endpoint = read_prog_str(strings::endpoint_scenes);
-  return post(&change, endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return post(&change, endpoint(strings::endpoint_scenes, id));
+}
+
+std::vector<Response<NamedValue>> Sphue::modifyScene(int id, SceneStateChange &change) {
+  return post(&change, endpoint(strings::endpoint_scenes, id));
+}
+
+bool Sphue::modifyScene(int id, SceneModificationRequest &change, ResultSummary &summary) {
+  const String &json = change.serializedBody();
+  return sendBody("POST", endpoint(strings::endpoint_scenes, id).c_str(), json.c_str(), json.length(), change.size(),
+                  summary);
+}
+
+bool Sphue::modifyScene(int id, SceneStateChange &change, ResultSummary &summary) {
+  const String &json = change.serializedBody();
+  return sendBody("POST", endpoint(strings::endpoint_scenes, id).c_str(), json.c_str(), json.length(), change.size(),
+                  summary);
 }
 
 Response<String> Sphue::deleteScene(int id) {
-  String endpoint = read_prog_str(strings::endpoint_scenes);
-  return del(endpoint_prefix, apiKey_, endpoint.c_str(), id);
+  return del(endpoint(strings::endpoint_scenes, id));
+}
+
+PreparedCommand Sphue::prepareLightState(int id, const StateChangeBuilder &change) {
+  return prepareState(endpoint(strings::endpoint_lights, id, "state"), change);
+}
+
+PreparedCommand Sphue::prepareLightState(int id, const LightStateChange &change) {
+  StateChangeBuilder builder;
+  return builder.assign(change) ? prepareLightState(id, builder) : PreparedCommand();
+}
+
+PreparedCommand Sphue::prepareGroupState(int id, const StateChangeBuilder &change) {
+  return prepareState(endpoint(strings::endpoint_groups, id, "action"), change);
+}
+
+PreparedCommand Sphue::prepareGroupState(int id, const GroupStateChange &change) {
+  StateChangeBuilder builder;
+  return builder.assign(change) ? prepareGroupState(id, builder) : PreparedCommand();
+}
+
+bool Sphue::send(const PreparedCommand &command) {
+  return command && putBody(command.path_, command.body_, command.length_, command.fields_);
+}
+
+void Sphue::getAllLightsAsync(const Callback<Lights> &callback) {
+  queue(new ResponseCall<Lights>(endpoint(strings::endpoint_lights), callback));
+}
+
+void Sphue::getLightAsync(int id, const Callback<Light> &callback) {
+  queue(new ResponseCall<Light>(endpoint(strings::endpoint_lights, id), callback));
+}
+
+void Sphue::setLightStateAsync(int id, LightStateChange &change, const SummaryCallback &callback) {
+  queue(new SummaryCall(endpoint(strings::endpoint_lights, id, "state"), change.serializedBody(), change.size(),
+                        callback));
+}
+
+void Sphue::getAllGroupsAsync(const Callback<Groups> &callback) {
+  queue(new ResponseCall<Groups>(endpoint(strings::endpoint_groups), callback));
+}
+
+void Sphue::getGroupAsync(int id, const Callback<Group> &callback) {
+  queue(new ResponseCall<Group>(endpoint(strings::endpoint_groups, id), callback));
+}
+
+void Sphue::setGroupStateAsync(int id, GroupStateChange &change, const SummaryCallback &callback) {
+  queue(new SummaryCall(endpoint(strings::endpoint_groups, id, "action"), change.serializedBody(), change.size(),
+                        callback));
+}
+
+void Sphue::getAllScenesAsync(const Callback<Scenes> &callback) {
+  queue(new ResponseCall<Scenes>(endpoint(strings::endpoint_scenes), callback));
+}
+
+void Sphue::getSceneAsync(int id, const Callback<Scene> &callback) {
+  queue(new ResponseCall<Scene>(endpoint(strings::endpoint_scenes, id), callback));
+}
+
+size_t Sphue::poll(unsigned long slice) {
+  const unsigned long start = millis();
+  while (!calls_.empty()) {
+    std::shared_ptr<Call> call = calls_.front();
+    http::AsyncResponse::Status status = http::AsyncResponse::FAILED;
+    if (!call->sent) {
+      call->sent = true;
+      call->started = millis();
+      call->response.reset();
+      const char *body = call->body.length() ? call->body.c_str() : nullptr;
+      if (connection_ && !connection_->write(call->method, call->path, body, call->body.length())) {
+        connection_->close();
+      }
+    }
+    if (connection_) {
+      status = connection_->poll(call->response);
+    }
+    if (status == http::AsyncResponse::RECEIVING) {
+      if (millis() - call->started < SPHUE_ASYNC_TIMEOUT) {
+        break;
+      }
+      connection_->close();
+      status = http::AsyncResponse::FAILED;
+    } else if (status == http::AsyncResponse::FAILED && connection_ && connection_->dropped() && !call->retried &&
+               http::Connection::isRetriable(call->method)) {
+      // The kept connection had closed before the request got through; It is sent again on a new one.
+      call->retried = true;
+      call->sent = false;
+      continue;
+    }
+    calls_.pop_front();
+    call->complete(*this, status == http::AsyncResponse::COMPLETE ? &call->response : nullptr);
+    if (millis() - start >= slice) {
+      break;
+    }
+  }
+  return calls_.size();
+}
+
+bool Sphue::forEachLight(const StreamedIntMap<Light>::Callback &callback) {
+  StreamedIntMap<Light> lights(callback);
+  return forEach(lights, endpoint(strings::endpoint_lights));
+}
+
+bool Sphue::forEachGroup(const StreamedIntMap<Group>::Callback &callback) {
+  StreamedIntMap<Group> groups(callback);
+  return forEach(groups, endpoint(strings::endpoint_groups));
+}
+
+bool Sphue::forEachScene(const StreamedStringMap<Scene>::Callback &callback) {
+  StreamedStringMap<Scene> scenes(callback);
+  return forEach(scenes, endpoint(strings::endpoint_scenes));
+}
+
+bool Sphue::streamLights(json::JsonHandler &handler) {
+  return stream(handler, endpoint(strings::endpoint_lights));
+}
+
+bool Sphue::streamGroups(json::JsonHandler &handler) {
+  return stream(handler, endpoint(strings::endpoint_groups));
+}
+
+bool Sphue::streamScenes(json::JsonHandler &handler) {
+  return stream(handler, endpoint(strings::endpoint_scenes));
+}
+
+bool Sphue::projectLights(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback) {
+  return project(paths, count, callback, endpoint(strings::endpoint_lights));
+}
+
+bool Sphue::projectGroups(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback) {
+  return project(paths, count, callback, endpoint(strings::endpoint_groups));
+}
+
+bool Sphue::projectScenes(const json::JsonPath *paths, uint8_t count, const json::JsonPathCallback &callback) {
+  return project(paths, count, callback, endpoint(strings::endpoint_scenes));
 }
 
 Response<RegisterResponse> Sphue::registerDeviceApiKey(const char *deviceName, const char *applicationName) {